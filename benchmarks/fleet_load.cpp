@@ -0,0 +1,386 @@
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <unistd.h>
+#include "mqtt/async_client.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Gerador de carga para o data_processor: simula uma frota de máquinas publicando
+// em /sensors/<máquina>/<sensor> num broker local e faz o papel do Graphite
+// (porta 2003), contando as linhas recebidas. O valor de cada leitura é o
+// instante de envio em milissegundos (módulo 10^6), o que permite medir a
+// latência ponta a ponta quando a métrica bruta chega ao "Graphite".
+
+#define DEFAULT_BROKER_ADDRESS "tcp://localhost:1883"
+#define DEFAULT_GRAPHITE_PORT 2003
+#define LATENCY_MODULUS 1000000 // O Graphite recebe o valor com 6 dígitos significativos
+#define DRAIN_SECONDS 3         // Espera pelas últimas métricas depois de parar de publicar
+
+struct LoadConfig {
+    std::string broker = DEFAULT_BROKER_ADDRESS;
+    int graphite_port = DEFAULT_GRAPHITE_PORT;
+    int machines = 1000;
+    int sensors = 2;
+    double rate = 1.0; // mensagens por segundo por sensor
+    int connections = 4;
+    int duration = 30; // segundos
+    int qos = 0;
+    pid_t processor_pid = 0;
+};
+
+LoadConfig load;
+
+// Conta o que chega ao "Graphite"
+std::atomic<uint64_t> lines_received{0};
+std::atomic<uint64_t> samples_received{0};
+std::atomic<uint64_t> messages_published{0};
+std::atomic<uint64_t> publish_failures{0};
+std::atomic<bool> publishing{true};
+std::mutex latency_mtx;
+std::vector<uint32_t> latencies_ms;
+
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string format_timestamp(int64_t epoch_ms) {
+    std::time_t seconds = epoch_ms / 1000;
+    std::tm now_tm;
+    gmtime_r(&seconds, &now_tm);
+    char buffer[32];
+    size_t length = std::strftime(buffer, sizeof(buffer), "%FT%T", &now_tm);
+    std::snprintf(buffer + length, sizeof(buffer) - length, ".%03dZ", static_cast<int>(epoch_ms % 1000));
+    return buffer;
+}
+
+// GRAPHITE SIMULADO -------------------------------------------------------------------------------------------
+
+// A métrica bruta de um sensor é "machines.<máquina>.<sensor>.<sensor>"; as demais
+// (média móvel, tendência, alarmes) só entram na contagem de linhas.
+bool is_raw_sample(const char* path, size_t length) {
+    const char* last_dot = static_cast<const char*>(memrchr(path, '.', length));
+    if (last_dot == nullptr) {
+        return false;
+    }
+    size_t last_length = length - (last_dot - path) - 1;
+    if (static_cast<size_t>(last_dot - path) < last_length + 1) {
+        return false;
+    }
+    const char* previous = last_dot - last_length;
+    return previous[-1] == '.' && std::memcmp(previous, last_dot + 1, last_length) == 0;
+}
+
+void handle_line(const char* line, size_t length, int64_t received_ms, std::vector<uint32_t>& local_latencies) {
+    lines_received.fetch_add(1, std::memory_order_relaxed);
+    const char* space = static_cast<const char*>(std::memchr(line, ' ', length));
+    if (space == nullptr || !is_raw_sample(line, space - line)) {
+        return;
+    }
+    samples_received.fetch_add(1, std::memory_order_relaxed);
+    int64_t sent = static_cast<int64_t>(std::strtod(space + 1, nullptr));
+    int64_t latency = ((received_ms % LATENCY_MODULUS) - sent + LATENCY_MODULUS) % LATENCY_MODULUS;
+    local_latencies.push_back(static_cast<uint32_t>(latency));
+}
+
+void serve_graphite_connection(int client_socket) {
+    std::vector<char> buffer(64 * 1024);
+    std::vector<uint32_t> local_latencies;
+    size_t pending = 0; // bytes de uma linha incompleta no início do buffer
+
+    while (true) {
+        ssize_t received = recv(client_socket, buffer.data() + pending, buffer.size() - pending, 0);
+        if (received <= 0) {
+            break;
+        }
+        int64_t received_ms = now_ms();
+        size_t end = pending + static_cast<size_t>(received);
+        size_t start = 0;
+        while (const char* newline = static_cast<const char*>(std::memchr(buffer.data() + start, '\n', end - start))) {
+            size_t line_end = newline - buffer.data();
+            handle_line(buffer.data() + start, line_end - start, received_ms, local_latencies);
+            start = line_end + 1;
+        }
+        pending = end - start;
+        std::memmove(buffer.data(), buffer.data() + start, pending);
+        if (pending == buffer.size()) {
+            pending = 0; // linha maior que o buffer: descarta
+        }
+
+        if (local_latencies.size() >= 4096) {
+            std::lock_guard<std::mutex> lock(latency_mtx);
+            latencies_ms.insert(latencies_ms.end(), local_latencies.begin(), local_latencies.end());
+            local_latencies.clear();
+        }
+    }
+    std::lock_guard<std::mutex> lock(latency_mtx);
+    latencies_ms.insert(latencies_ms.end(), local_latencies.begin(), local_latencies.end());
+    close(client_socket);
+}
+
+int start_graphite_listener(int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1 || listen(listener, 16) == -1) {
+        std::cerr << "Error: Could not listen on port " << port << ": " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    std::thread([listener] {
+        while (true) {
+            int client_socket = accept(listener, nullptr, nullptr);
+            if (client_socket == -1) {
+                continue;
+            }
+            std::thread(serve_graphite_connection, client_socket).detach();
+        }
+    }).detach();
+    return listener;
+}
+
+// FROTA SIMULADA ----------------------------------------------------------------------------------------------
+
+// Cada conexão publica as leituras de uma fatia das máquinas, espaçadas igualmente no tempo
+void run_publisher(int index, int first_machine, int last_machine) {
+    mqtt::async_client client(load.broker, "fleet_load_" + std::to_string(getpid()) + "_" + std::to_string(index));
+    mqtt::connect_options connOpts;
+    connOpts.set_keep_alive_interval(20);
+    connOpts.set_clean_session(true);
+    try {
+        client.connect(connOpts)->wait();
+    } catch (mqtt::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        publishing = false;
+        return;
+    }
+
+    std::vector<std::string> topics;
+    for (int machine = first_machine; machine < last_machine; ++machine) {
+        for (int sensor = 0; sensor < load.sensors; ++sensor) {
+            topics.push_back("/sensors/machine" + std::to_string(machine) + "/bench" + std::to_string(sensor));
+        }
+    }
+    if (topics.empty()) {
+        return;
+    }
+
+    const double messages_per_second = topics.size() * load.rate;
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t sent = 0;
+    while (publishing) {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t due = static_cast<uint64_t>(elapsed * messages_per_second);
+        for (; sent < due && publishing; ++sent) {
+            int64_t timestamp = now_ms();
+            std::string payload = "{\"timestamp\": \"" + format_timestamp(timestamp) + "\", \"value\": " +
+                                  std::to_string(timestamp % LATENCY_MODULUS) + "}";
+            try {
+                client.publish(topics[sent % topics.size()], payload, load.qos, false);
+                messages_published.fetch_add(1, std::memory_order_relaxed);
+            } catch (mqtt::exception&) {
+                publish_failures.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    try {
+        client.disconnect()->wait();
+    } catch (mqtt::exception&) {
+    }
+}
+
+// MEDIÇÃO -----------------------------------------------------------------------------------------------------
+
+// Procura o data_processor em /proc quando o pid não é informado
+pid_t find_processor_pid() {
+    DIR* proc = opendir("/proc");
+    if (proc == nullptr) {
+        return 0;
+    }
+    pid_t found = 0;
+    while (struct dirent* entry = readdir(proc)) {
+        pid_t pid = std::atoi(entry->d_name);
+        if (pid <= 0) {
+            continue;
+        }
+        std::ifstream comm("/proc/" + std::to_string(pid) + "/comm");
+        std::string name;
+        if (std::getline(comm, name) && name == "data_processor") {
+            found = pid;
+            break;
+        }
+    }
+    closedir(proc);
+    return found;
+}
+
+// Tempo de CPU (usuário + sistema) do processo, em segundos
+double process_cpu_seconds(pid_t pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string content;
+    if (pid == 0 || !std::getline(stat, content)) {
+        return 0.0;
+    }
+    // Os campos depois do nome (que pode ter espaços) começam após o último ')'
+    std::istringstream fields(content.substr(content.rfind(')') + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14) {
+            utime = std::stoull(field);
+        } else if (i == 15) {
+            stime = std::stoull(field);
+        }
+    }
+    return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void print_usage(const char* program) {
+    std::cout << "Uso: " << program << " [--broker URI] [--graphite-port N] [--machines N] [--sensors N]\n"
+              << "       [--rate msgs/s por sensor] [--connections N] [--duration s] [--qos 0|1] [--processor-pid PID]"
+              << std::endl;
+}
+
+bool parse_arguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+        if (option == "--broker") {
+            load.broker = value;
+        } else if (option == "--graphite-port") {
+            load.graphite_port = std::stoi(value);
+        } else if (option == "--machines") {
+            load.machines = std::stoi(value);
+        } else if (option == "--sensors") {
+            load.sensors = std::stoi(value);
+        } else if (option == "--rate") {
+            load.rate = std::stod(value);
+        } else if (option == "--connections") {
+            load.connections = std::max(1, std::stoi(value));
+        } else if (option == "--duration") {
+            load.duration = std::stoi(value);
+        } else if (option == "--qos") {
+            load.qos = std::stoi(value);
+        } else if (option == "--processor-pid") {
+            load.processor_pid = std::stoi(value);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// MAIN --------------------------------------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+    try {
+        if (!parse_arguments(argc, argv)) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    } catch (const std::exception&) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (start_graphite_listener(load.graphite_port) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (load.processor_pid == 0) {
+        load.processor_pid = find_processor_pid();
+    }
+    if (load.processor_pid == 0) {
+        std::cerr << "Warning: data_processor not found, CPU usage will not be reported" << std::endl;
+    }
+
+    std::cout << "Simulando " << load.machines << " máquinas x " << load.sensors << " sensores a " << load.rate
+              << " msgs/s (" << load.machines * load.sensors * load.rate << " msgs/s no total) por "
+              << load.duration << " s" << std::endl;
+
+    // Espera o data_processor se conectar ao "Graphite" antes de começar a medir
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    double cpu_start = process_cpu_seconds(load.processor_pid);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> publishers;
+    int machines_per_connection = (load.machines + load.connections - 1) / load.connections;
+    for (int i = 0; i < load.connections; ++i) {
+        int first = i * machines_per_connection;
+        int last = std::min(load.machines, first + machines_per_connection);
+        publishers.emplace_back(run_publisher, i, first, last);
+    }
+
+    uint64_t last_samples = 0;
+    for (int second = 0; second < load.duration && publishing; ++second) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        uint64_t samples = samples_received.load();
+        std::cout << "[" << second + 1 << "s] publicadas " << messages_published.load() << ", processadas "
+                  << samples << " (" << samples - last_samples << "/s), linhas " << lines_received.load() << std::endl;
+        last_samples = samples;
+    }
+    publishing = false;
+    for (auto& publisher : publishers) {
+        publisher.join();
+    }
+    double publish_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::this_thread::sleep_for(std::chrono::seconds(DRAIN_SECONDS));
+    double cpu_seconds = process_cpu_seconds(load.processor_pid) - cpu_start;
+
+    std::vector<uint32_t> sorted;
+    {
+        std::lock_guard<std::mutex> lock(latency_mtx);
+        sorted = latencies_ms;
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    uint64_t published = messages_published.load();
+    uint64_t samples = samples_received.load();
+    std::cout << "\n--- Resultado ---\n"
+              << "Mensagens publicadas:   " << published << " (" << published / publish_seconds << " msgs/s)\n"
+              << "Falhas de publicação:   " << publish_failures.load() << "\n"
+              << "Amostras processadas:   " << samples << " (" << samples / publish_seconds << " msgs/s sustentadas, "
+              << (published > 0 ? 100.0 * samples / published : 0.0) << "% entregues)\n"
+              << "Linhas no Graphite:     " << lines_received.load() << "\n"
+              << "Latência (ms) p50 " << percentile(sorted, 0.50) << ", p90 " << percentile(sorted, 0.90) << ", p99 "
+              << percentile(sorted, 0.99) << ", p99.9 " << percentile(sorted, 0.999) << ", máx "
+              << (sorted.empty() ? 0 : sorted.back()) << "\n";
+    if (load.processor_pid != 0 && samples > 0) {
+        std::cout << "CPU do data_processor:  " << cpu_seconds << " s (" << cpu_seconds * 1e6 / samples
+                  << " µs por mensagem)\n";
+    }
+    std::cout << std::flush;
+
+    // As threads do "Graphite" continuam presas em recv(); encerra sem esperá-las
+    std::_Exit(EXIT_SUCCESS);
+}
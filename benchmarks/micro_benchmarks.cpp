@@ -0,0 +1,148 @@
+// Micro-benchmarks das funções de cálculo do data_processor. O arquivo do
+// data_processor é incluído diretamente, sem o main.
+#define DATA_PROCESSOR_NO_MAIN
+#include "data_processor.cpp"
+
+#include <benchmark/benchmark.h>
+#include <random>
+
+// Janela cheia com valores aleatórios, como em regime permanente
+static RollingWindow make_window(size_t capacity) {
+    RollingWindow window(capacity);
+    std::mt19937 generator(42);
+    std::normal_distribution<double> distribution(50.0, 10.0);
+    for (size_t i = 0; i < capacity; ++i) {
+        window.push(distribution(generator));
+    }
+    return window;
+}
+
+static void BM_CalculateZScore(benchmark::State& state) {
+    RollingWindow window = make_window(static_cast<size_t>(state.range(0)));
+    double value = 63.2;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(calculateZScore(value, window));
+    }
+}
+BENCHMARK(BM_CalculateZScore)->Arg(MOVING_AVERAGE_WINDOW)->Arg(1024);
+
+static void BM_CalculateTrend(benchmark::State& state) {
+    RollingWindow window = make_window(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(calculateTrend(window));
+    }
+}
+BENCHMARK(BM_CalculateTrend)->Arg(MOVING_AVERAGE_WINDOW)->Arg(1024);
+
+// Inclui a atualização da janela, que é o custo real por amostra
+static void BM_RollingWindowPush(benchmark::State& state) {
+    RollingWindow window = make_window(static_cast<size_t>(state.range(0)));
+    double value = 0.0;
+    for (auto _ : state) {
+        window.push(value);
+        value += 0.5;
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_RollingWindowPush)->Arg(MOVING_AVERAGE_WINDOW)->Arg(1024);
+
+static void BM_QuantileSketchAdd(benchmark::State& state) {
+    QuantileSketch sketch(std::chrono::seconds(3600));
+    std::mt19937 generator(42);
+    std::lognormal_distribution<double> distribution(3.0, 1.0);
+    std::time_t timestamp = 1685633400;
+    for (auto _ : state) {
+        sketch.add(distribution(generator), timestamp++);
+    }
+}
+BENCHMARK(BM_QuantileSketchAdd);
+
+static void BM_QuantileSketchQuantile(benchmark::State& state) {
+    QuantileSketch sketch(std::chrono::seconds(3600));
+    std::mt19937 generator(42);
+    std::lognormal_distribution<double> distribution(3.0, 1.0);
+    for (std::time_t timestamp = 0; timestamp < 100000; ++timestamp) {
+        sketch.add(distribution(generator), timestamp);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sketch.quantile(0.999));
+    }
+}
+BENCHMARK(BM_QuantileSketchQuantile);
+
+static void BM_StringToTimeT(benchmark::State& state) {
+    const std::string timestamp = "2023-06-01T15:30:00.123Z";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(string_to_time_t(timestamp));
+    }
+}
+BENCHMARK(BM_StringToTimeT);
+
+// Formato que cai no caminho lento (std::get_time)
+static void BM_StringToTimeTFallback(benchmark::State& state) {
+    const std::string timestamp = "2023-06-01T15:30:00 UTC";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(string_to_time_t(timestamp));
+    }
+}
+BENCHMARK(BM_StringToTimeTFallback);
+
+static void BM_Split(benchmark::State& state) {
+    const std::string topic = "/sensors/machine-0042/cpu_usage";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(split(topic, '/'));
+    }
+}
+BENCHMARK(BM_Split);
+
+// Enfileiramento no destino plaintext; sem a thread de envio a fila só descarta as métricas mais antigas
+static void BM_PostMetric(benchmark::State& state) {
+    const std::string machine_id = "machine-0042";
+    const std::string sensor_id = "cpu_usage.cpu_usage";
+    std::time_t timestamp = 1685633400;
+    double value = 42.125;
+    metric_sinks = {&graphite_sender};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(post_metric(machine_id, sensor_id, timestamp, value));
+    }
+    metric_sinks.clear();
+}
+BENCHMARK(BM_PostMetric);
+
+// Formatação de um lote de GRAPHITE_FRAME_METRICS métricas, feita pela thread de envio
+static std::vector<Metric> make_metrics() {
+    std::vector<Metric> metrics;
+    for (size_t i = 0; i < GRAPHITE_FRAME_METRICS; ++i) {
+        metrics.push_back({"machines.machine-" + std::to_string(i) + ".cpu_usage.cpu_usage",
+                           static_cast<std::time_t>(1685633400 + i), 42.125 + i * 0.01});
+    }
+    return metrics;
+}
+
+static void BM_FormatPlaintext(benchmark::State& state) {
+    std::vector<Metric> metrics = make_metrics();
+    std::string out;
+    for (auto _ : state) {
+        out.clear();
+        for (const Metric& metric : metrics) {
+            append_plaintext(out, metric);
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * metrics.size());
+}
+BENCHMARK(BM_FormatPlaintext);
+
+static void BM_FormatPickle(benchmark::State& state) {
+    std::vector<Metric> metrics = make_metrics();
+    std::string out;
+    for (auto _ : state) {
+        out.clear();
+        append_pickle_frame(out, metrics, 0, metrics.size());
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * metrics.size());
+}
+BENCHMARK(BM_FormatPickle);
+
+BENCHMARK_MAIN();
@@ -10,345 +10,5238 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <climits>
+#include <cerrno>
 #include <ctime>
 #include <iomanip>
 #include <sstream>
 #include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <atomic>
+#include <array>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <unordered_map>
+#include <set>
+#include <map>
+#include <fstream>
+#include <stdexcept>
+#include <filesystem>
+#include <utility>
+#include <cstdio>
 #include <cmath>
-#include <ctime>
+#include <charconv>
+#include <endian.h>
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <string_view>
+
+#define QOS 1
+#define BROKER_ADDRESS "tcp://localhost:1883"
+#define SENSOR_MONITORS_TOPIC "/sensor_monitors" // Anúncio dos sensores de cada máquina
+#define GRAPHITE_HOST "127.0.0.1"
+#define GRAPHITE_PORT 2003
+
+// Definição de cores ANSI para o console
+#define RESET   "\033[0m"
+#define RED     "\033[31m"      /* Red */
+
+// LOG ----------------------------------------------------------------------------------------------------------
+
+#define LOG_RING_RECORDS 2048       // Registros pendentes por thread (potência de 2)
+#define LOG_TEXT_BYTES 160          // Mensagens de texto maiores são truncadas
+#define LOG_FLUSH_INTERVAL_MS 50    // Intervalo entre as escritas da thread de log
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error, Off };
+
+bool parse_log_level(std::string_view name, LogLevel& level) {
+    static const std::pair<std::string_view, LogLevel> levels[] = {
+        {"debug", LogLevel::Debug}, {"info", LogLevel::Info}, {"warn", LogLevel::Warn},
+        {"error", LogLevel::Error}, {"off", LogLevel::Off},
+    };
+    for (const auto& [level_name, value] : levels) {
+        if (name == level_name) {
+            level = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* log_level_name(LogLevel level) {
+    static const char* names[] = {"debug", "info", "warn", "error", "off"};
+    return names[static_cast<size_t>(level)];
+}
+
+// Tipos de registro. Os eventos do processamento guardam só números e ponteiros
+// para os nomes (que vivem no registro de sensores até o fim do processo); o
+// texto é montado pela thread de log.
+enum class LogEvent : uint8_t { Text, SensorReport, AlarmFired, AlarmCleared, InactivityAlarm };
+
+struct LogRecord {
+    int64_t time_ns;
+    LogLevel level;
+    LogEvent event;
+    bool outlier;
+    uint16_t text_size;
+    const std::string* machine;
+    const std::string* sensor;
+    const std::string* rule; // nome da regra, em AlarmFired e AlarmCleared
+    std::time_t timestamp;
+    double value;
+    double moving_average;
+    double trend;
+    char text[LOG_TEXT_BYTES];
+};
+
+// Fila circular de um produtor (a thread dona) e um consumidor (a thread de log).
+// Se encher, o registro é descartado: quem registra nunca espera.
+class LogRing {
+public:
+    template <typename Fill>
+    bool try_push(Fill&& fill) {
+        size_t tail = tail_pos.load(std::memory_order_relaxed);
+        if (tail - head_pos.load(std::memory_order_acquire) == LOG_RING_RECORDS) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        fill(records[tail & (LOG_RING_RECORDS - 1)]);
+        tail_pos.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename Consume>
+    void drain(Consume&& consume) {
+        size_t head = head_pos.load(std::memory_order_relaxed);
+        size_t tail = tail_pos.load(std::memory_order_acquire);
+        for (; head != tail; ++head) {
+            consume(records[head & (LOG_RING_RECORDS - 1)]);
+        }
+        head_pos.store(head, std::memory_order_release);
+    }
+
+    std::atomic<uint64_t> dropped{0};
+
+private:
+    std::array<LogRecord, LOG_RING_RECORDS> records{};
+    alignas(64) std::atomic<size_t> head_pos{0};
+    alignas(64) std::atomic<size_t> tail_pos{0};
+};
+
+// Log assíncrono: cada thread grava registros binários na sua própria fila e uma
+// thread de fundo os ordena, formata e escreve. Alarmes e avisos repetidos (mesma
+// série ou mesmo texto) dentro de `coalesce_interval` são suprimidos e contados.
+class Logger {
+public:
+    ~Logger() {
+        stop();
+    }
+
+    bool enabled(LogLevel level) const {
+        return level >= current_level.load(std::memory_order_relaxed);
+    }
+
+    void set_level(LogLevel level) {
+        current_level.store(level, std::memory_order_relaxed);
+    }
+
+    LogLevel level() const {
+        return current_level.load(std::memory_order_relaxed);
+    }
+
+    // Chama fill(LogRecord&) sobre um registro livre da fila desta thread
+    template <typename Fill>
+    void push(LogLevel level, LogEvent event, Fill&& fill) {
+        thread_ring().try_push([&](LogRecord& record) {
+            record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            record.level = level;
+            record.event = event;
+            fill(record);
+        });
+    }
+
+    void push_text(LogLevel level, std::string_view text) {
+        push(level, LogEvent::Text, [&](LogRecord& record) {
+            record.text_size = static_cast<uint16_t>(std::min<size_t>(text.size(), LOG_TEXT_BYTES));
+            std::memcpy(record.text, text.data(), record.text_size);
+        });
+    }
+
+    void start(std::chrono::seconds repeat_interval) {
+        coalesce_interval_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(repeat_interval).count();
+        running = true;
+        logger_thread = std::thread(&Logger::run, this);
+    }
+
+    // Escreve o que estiver pendente e encerra a thread de log
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(logger_mtx);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        logger_cv.notify_one();
+        if (logger_thread.joinable()) {
+            logger_thread.join();
+        }
+    }
+
+private:
+    struct Repeat {
+        int64_t last_written_ns = 0;
+        uint64_t suppressed = 0;
+    };
+
+    LogRing& thread_ring() {
+        thread_local LogRing* ring = nullptr;
+        if (ring == nullptr) {
+            std::lock_guard<std::mutex> lock(rings_mtx);
+            rings.push_back(std::make_unique<LogRing>());
+            ring = rings.back().get();
+        }
+        return *ring;
+    }
+
+    void run() {
+        while (true) {
+            bool keep_running;
+            {
+                std::unique_lock<std::mutex> lock(logger_mtx);
+                logger_cv.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS), [this] { return !running; });
+                keep_running = running;
+            }
+            flush();
+            if (!keep_running) {
+                return;
+            }
+        }
+    }
+
+    void flush() {
+        pending.clear();
+        uint64_t dropped = 0;
+        {
+            std::lock_guard<std::mutex> lock(rings_mtx);
+            for (auto& ring : rings) {
+                ring->drain([this](const LogRecord& record) {
+                    pending.push_back(record);
+                });
+                dropped += ring->dropped.load(std::memory_order_relaxed);
+            }
+        }
+        // As filas são de threads diferentes: intercala pela hora de registro
+        std::stable_sort(pending.begin(), pending.end(), [](const LogRecord& a, const LogRecord& b) {
+            return a.time_ns < b.time_ns;
+        });
+
+        std::string out, err;
+        for (const LogRecord& record : pending) {
+            format(record, record.level >= LogLevel::Warn && record.event == LogEvent::Text ? err : out);
+        }
+        if (dropped > reported_drops) {
+            err += "Warning: Log buffer full, " + std::to_string(dropped - reported_drops) + " record(s) discarded\n";
+            reported_drops = dropped;
+        }
+        if (!out.empty()) {
+            std::cout.write(out.data(), out.size()).flush();
+        }
+        if (!err.empty()) {
+            std::cerr.write(err.data(), err.size());
+        }
+    }
+
+    // Decide se um registro repetido é escrito; devolve quantos foram suprimidos antes dele
+    bool should_write(uint64_t key, int64_t time_ns, uint64_t& suppressed) {
+        if (coalesce_interval_ns <= 0) {
+            suppressed = 0;
+            return true;
+        }
+        Repeat& repeat = repeats[key];
+        if (repeat.last_written_ns != 0 && time_ns - repeat.last_written_ns < coalesce_interval_ns) {
+            ++repeat.suppressed;
+            return false;
+        }
+        suppressed = std::exchange(repeat.suppressed, 0);
+        repeat.last_written_ns = time_ns;
+        return true;
+    }
+
+    void format(const LogRecord& record, std::string& out) {
+        uint64_t key = 0;
+        switch (record.event) {
+        case LogEvent::Text:
+            key = std::hash<std::string_view>()(std::string_view(record.text, record.text_size));
+            break;
+        case LogEvent::AlarmFired:
+        case LogEvent::AlarmCleared:
+        case LogEvent::InactivityAlarm:
+            key = std::hash<const void*>()(record.machine) * 31 + std::hash<const void*>()(record.sensor) * 7 +
+                  std::hash<const void*>()(record.rule) * 17 + static_cast<uint64_t>(record.event);
+            break;
+        case LogEvent::SensorReport:
+            break;
+        }
+        uint64_t suppressed = 0;
+        if (record.event != LogEvent::SensorReport && record.level >= LogLevel::Warn &&
+            !should_write(key, record.time_ns, suppressed)) {
+            return;
+        }
+
+        std::ostringstream line;
+        switch (record.event) {
+        case LogEvent::Text:
+            line.write(record.text, record.text_size);
+            break;
+        case LogEvent::SensorReport: {
+            const std::string& sensor_id = *record.sensor;
+            std::tm time;
+            gmtime_r(&record.timestamp, &time);
+            line << "\n\n" << "--------------------->    Análise de dados para o sensor " << sensor_id << "   <---------------------\n";
+            line << "Data: " << std::put_time(&time, "%d/%m/%Y, Hora: %H:%M:%S") << "\n";
+            line << "ID da máquina: " << *record.machine << "\n";
+            line << "Média móvel do uso de " << sensor_id << ": " << record.moving_average << "\n";
+            if (record.outlier) {
+                line << RED << "[ALARME]" << RESET << " Outlier detectado: " << record.value << "\n";
+            } else {
+                line << "Uso normal de " << sensor_id << ": " << record.value << "\n";
+            }
+            line << "Tendência do uso de " << sensor_id << ": " << record.trend << "\n";
+            line << "----------------------------------------------------------------------------------------------";
+            break;
+        }
+        case LogEvent::AlarmFired:
+            line << RED << "[ALARME]" << RESET << " " << *record.rule << " disparado: " << record.value << " (máquina "
+                 << *record.machine << ", sensor " << *record.sensor << ")";
+            break;
+        case LogEvent::AlarmCleared:
+            line << "[ALARME] " << *record.rule << " normalizado (máquina " << *record.machine << ", sensor "
+                 << *record.sensor << ")";
+            break;
+        case LogEvent::InactivityAlarm:
+            line << RED << "\n⚠️ - [ALARME] " << RESET << "Dados do sensor " << *record.sensor << " da máquina "
+                 << *record.machine << " não foram recebidos por mais de 10 períodos de tempo previstos.";
+            break;
+        }
+        if (suppressed > 0) {
+            line << " (+" << suppressed << " repetição(ões) suprimida(s))";
+        }
+        line << "\n";
+        out += line.str();
+    }
+
+    std::atomic<LogLevel> current_level{LogLevel::Info};
+    std::mutex rings_mtx;
+    std::vector<std::unique_ptr<LogRing>> rings;
+
+    // Usados apenas pela thread de log
+    std::vector<LogRecord> pending;
+    std::unordered_map<uint64_t, Repeat> repeats;
+    uint64_t reported_drops = 0;
+    int64_t coalesce_interval_ns = 0;
+
+    std::mutex logger_mtx;
+    std::condition_variable logger_cv;
+    bool running = false;
+    std::thread logger_thread;
+};
+
+Logger logger;
+
+bool log_enabled(LogLevel level) {
+    return logger.enabled(level);
+}
+
+// Mensagem de texto livre; os argumentos só são formatados se o nível estiver ativo
+template <typename... Args>
+void log_text(LogLevel level, const Args&... args) {
+    if (!log_enabled(level)) {
+        return;
+    }
+    std::ostringstream text;
+    (text << ... << args);
+    logger.push_text(level, text.str());
+}
+
+// CÁLCULO E CONVERSÃO -------------------------------------------------------------------------------------------
+
+// Lê exatamente `count` dígitos decimais a partir de text[pos]
+bool parse_digits(std::string_view text, size_t pos, size_t count, int& out) {
+    if (pos + count > text.size()) {
+        return false;
+    }
+    out = 0;
+    for (size_t i = pos; i < pos + count; ++i) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+        out = out * 10 + (text[i] - '0');
+    }
+    return true;
+}
+
+// Número de dias desde 1970-01-01 no calendário gregoriano proleptico
+std::int64_t days_from_civil(int year, int month, int day) {
+    year -= month <= 2;
+    const std::int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned year_of_era = static_cast<unsigned>(year - era * 400);
+    const unsigned day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + static_cast<std::int64_t>(day_of_era) - 719468;
+}
+
+// Converte um timestamp ISO 8601 ("AAAA-MM-DDTHH:MM:SS[.fração][Z|±HH:MM]") em
+// segundos desde a época. Sem designador de fuso o horário é considerado UTC.
+// Não aloca nem depende do locale/fuso da máquina, ao contrário de mktime.
+bool parse_iso8601_utc(std::string_view text, std::time_t& out) {
+    int year, month, day, hour, minute, second;
+    if (!parse_digits(text, 0, 4, year) || text.size() < 19 || text[4] != '-' ||
+        !parse_digits(text, 5, 2, month) || text[7] != '-' ||
+        !parse_digits(text, 8, 2, day) || (text[10] != 'T' && text[10] != 't' && text[10] != ' ') ||
+        !parse_digits(text, 11, 2, hour) || text[13] != ':' ||
+        !parse_digits(text, 14, 2, minute) || text[16] != ':' ||
+        !parse_digits(text, 17, 2, second)) {
+        return false;
+    }
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return false;
+    }
+
+    size_t pos = 19;
+    if (pos < text.size() && (text[pos] == '.' || text[pos] == ',')) {
+        do {
+            ++pos; // A fração de segundo é descartada (o Graphite trabalha em segundos)
+        } while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9');
+    }
+
+    int offset_seconds = 0;
+    if (pos < text.size()) {
+        if ((text[pos] == 'Z' || text[pos] == 'z') && pos + 1 == text.size()) {
+            pos += 1;
+        } else if (text[pos] == '+' || text[pos] == '-') {
+            int offset_hour, offset_minute;
+            if (!parse_digits(text, pos + 1, 2, offset_hour) || pos + 6 != text.size() || text[pos + 3] != ':' ||
+                !parse_digits(text, pos + 4, 2, offset_minute)) {
+                return false;
+            }
+            offset_seconds = (offset_hour * 3600 + offset_minute * 60) * (text[pos] == '+' ? 1 : -1);
+            pos += 6;
+        } else {
+            return false;
+        }
+    }
+
+    out = static_cast<std::time_t>(days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second -
+                                   offset_seconds);
+    return true;
+}
+
+std::time_t string_to_time_t(const std::string& time_string) {
+    std::time_t time;
+    if (parse_iso8601_utc(time_string, time)) {
+        return time;
+    }
+
+    // Formatos inesperados ainda passam pelo caminho genérico, também em UTC
+    std::tm tm = {};
+    std::istringstream ss(time_string);
+    ss >> std::get_time(&tm, "%Y-%m-%dT%H:%M:%S");
+    return timegm(&tm);
+}
+
+// Defina o tamanho padrão da janela para a média móvel
+const size_t MOVING_AVERAGE_WINDOW = 5; // Por exemplo, uma janela de tamanho 5
+const int64_t MAX_WINDOW = 1000000;     // Maior janela aceita na configuração (8 MB por série)
+
+// Janela deslizante de capacidade fixa sobre um buffer circular. As somas usadas
+// pela média, variância e regressão linear são atualizadas em O(1) a cada valor
+// que entra ou sai, então o custo por mensagem não depende do tamanho da janela.
+// As somas são dos valores menos `shift` (a média no último recálculo): com
+// valores grandes e pouco dispersos, sum_sq / n - média² sobre os valores brutos
+// perderia todos os dígitos significativos na subtração.
+class RollingWindow {
+public:
+    explicit RollingWindow(size_t capacity) : ring(std::max<size_t>(capacity, 1)) {}
+
+    void push(double value) {
+        size_t capacity = ring.size();
+        if (count == 0) {
+            shift = value;
+        }
+        if (count == capacity) {
+            // A janela está cheia: o valor mais antigo (x = 1) sai e todos os
+            // demais recuam uma posição, o que reduz sum_xy em sum (já sem ele).
+            double oldest = ring[head] - shift;
+            sum -= oldest;
+            sum_sq -= oldest * oldest;
+            sum_xy -= oldest;
+            sum_xy -= sum;
+            ring[head] = value;
+            head = (head + 1) % capacity;
+        } else {
+            ring[(head + count) % capacity] = value;
+            ++count;
+        }
+        double shifted = value - shift;
+        sum += shifted;
+        sum_sq += shifted * shifted;
+        sum_xy += static_cast<double>(count) * shifted;
+
+        // Recalcula as somas de tempos em tempos para não acumular erro de arredondamento
+        if (++pushes_since_resync >= capacity) {
+            resync();
+        }
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return ring.size(); }
+
+    double mean() const {
+        return count == 0 ? 0.0 : shift + sum / static_cast<double>(count);
+    }
+
+    double variance() const {
+        if (count == 0) {
+            return 0.0;
+        }
+        double m = sum / static_cast<double>(count);
+        return std::max(0.0, sum_sq / static_cast<double>(count) - m * m);
+    }
+
+    // Inclinação da regressão linear dos valores contra suas posições 1..n. O
+    // deslocamento não a altera: somar uma constante aos valores não muda a reta.
+    double slope() const {
+        if (count < 2) {
+            return 0.0;
+        }
+        double n = static_cast<double>(count);
+        double sum_x = n * (n + 1) / 2;
+        double denominator = n * n * (n * n - 1) / 12; // n * sum(x²) - sum(x)²
+        return (n * sum_xy - sum_x * sum) / denominator;
+    }
+
+private:
+    void resync() {
+        double total = 0.0;
+        for (size_t i = 0; i < count; ++i) {
+            total += ring[(head + i) % ring.size()];
+        }
+        shift = count == 0 ? 0.0 : total / static_cast<double>(count);
+        sum = sum_sq = sum_xy = 0.0;
+        for (size_t i = 0; i < count; ++i) {
+            double value = ring[(head + i) % ring.size()] - shift;
+            sum += value;
+            sum_sq += value * value;
+            sum_xy += static_cast<double>(i + 1) * value;
+        }
+        pushes_since_resync = 0;
+    }
+
+    std::vector<double> ring;
+    size_t head = 0;  // posição do valor mais antigo
+    size_t count = 0;
+    double shift = 0.0; // subtraído de cada valor antes de entrar nas somas
+    double sum = 0.0, sum_sq = 0.0, sum_xy = 0.0;
+    size_t pushes_since_resync = 0;
+};
+
+// Função para calcular a média móvel de um conjunto de valores
+double calculateMovingAverage(const RollingWindow& values) {
+    return values.mean(); // Se a janela estiver vazia, retorna 0 como média móvel
+}
+
+// Função para calcular o Z-score de um valor em relação a um conjunto de dados
+double calculateZScore(double value, const RollingWindow& values) {
+    double stdDeviation = std::sqrt(values.variance());
+
+    if (stdDeviation == 0.0) {
+        return 0.0; // Retorna 0 se o desvio padrão for zero (ou a janela estiver vazia) para evitar divisão por zero
+    }
+
+    return (value - values.mean()) / stdDeviation;
+}
+
+// Função para calcular a tendência usando regressão linear simples
+double calculateTrend(const RollingWindow& values) {
+    return values.slope();
+}
+
+#define SKETCH_RELATIVE_ACCURACY 0.02      // Erro relativo máximo de um quantil
+#define SKETCH_MAX_BINS 2048               // Baldes por sinal; cobrem uma faixa de ~10^35 entre menor e maior valor
+#define SKETCH_MIN_VALUE 1e-9              // Valores menores que isso (em módulo) contam como zero
+#define SKETCH_RENORMALIZE_WEIGHT 4294967296.0
+
+// Contagens de um sinal do sketch em baldes consecutivos a partir de `offset`. A
+// faixa cresce conforme chegam valores fora dela, então a memória acompanha a
+// dispersão real dos dados (~170 baldes para valores que variam 1000x). Só se ela
+// passar de SKETCH_MAX_BINS os baldes mais baixos são somados ao primeiro.
+class SketchStore {
+public:
+    void add(int key, double weight) {
+        if (bins.empty()) {
+            cover(key, key);
+        } else if (key < offset || key >= top()) {
+            cover(std::min(key, offset), std::max(key, top() - 1));
+        }
+        bins[std::max(key - offset, 0)] += weight;
+        total_weight += weight;
+    }
+
+    void merge(const SketchStore& other) {
+        if (other.bins.empty()) {
+            return;
+        }
+        if (bins.empty()) {
+            cover(other.offset, other.top() - 1);
+        } else {
+            cover(std::min(offset, other.offset), std::max(top(), other.top()) - 1);
+        }
+        for (size_t i = 0; i < other.bins.size(); ++i) {
+            if (other.bins[i] > 0.0) {
+                add(other.offset + static_cast<int>(i), other.bins[i]);
+            }
+        }
+    }
+
+    void scale(double factor) {
+        for (double& count : bins) {
+            count *= factor;
+        }
+        total_weight *= factor;
+    }
+
+    double total() const {
+        return total_weight;
+    }
+
+    // Percorre os baldes não vazios em ordem crescente de chave (ou decrescente);
+    // visit(chave, contagem) devolve true para parar
+    template <typename Visit>
+    bool visit(bool ascending, Visit&& visit) const {
+        int size = static_cast<int>(bins.size());
+        for (int n = 0; n < size; ++n) {
+            int i = ascending ? n : size - 1 - n;
+            if (bins[i] > 0.0 && visit(offset + i, bins[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    int top() const {
+        return offset + static_cast<int>(bins.size());
+    }
+
+    // Passa a cobrir as chaves [low, high], limitando-se às SKETCH_MAX_BINS mais altas
+    void cover(int low, int high) {
+        low = std::max(low, high - SKETCH_MAX_BINS + 1);
+        if (!bins.empty() && low == offset && high == top() - 1) {
+            return;
+        }
+        std::vector<double> resized(static_cast<size_t>(high - low + 1), 0.0);
+        for (size_t i = 0; i < bins.size(); ++i) {
+            resized[std::max(offset + static_cast<int>(i) - low, 0)] += bins[i];
+        }
+        bins.swap(resized);
+        offset = low;
+    }
+
+    std::vector<double> bins;
+    int offset = 0;
+    double total_weight = 0.0;
+};
+
+// Sketch de quantis no estilo DDSketch: cada valor cai num balde logarítmico, o
+// que garante erro relativo de SKETCH_RELATIVE_ACCURACY em qualquer quantil, com
+// memória proporcional ao logaritmo da faixa dos valores e atualização O(1). Com half_life > 0 a distribuição
+// esquece o passado com decaimento exponencial: em vez de reduzir todas as
+// contagens a cada amostra, as novas amostras entram com peso crescente
+// (2^(t / half_life)) e o sketch é renormalizado quando os pesos ficam grandes.
+// Dois sketches com os mesmos parâmetros podem ser combinados com merge().
+class QuantileSketch {
+public:
+    explicit QuantileSketch(std::chrono::seconds half_life = std::chrono::seconds(0))
+        : half_life(static_cast<double>(half_life.count())) {}
+
+    void add(double value, std::time_t timestamp) {
+        double weight = 1.0;
+        if (half_life > 0.0) {
+            if (samples == 0) {
+                landmark = timestamp;
+            }
+            weight = std::exp2((timestamp - landmark) / half_life);
+            if (weight > SKETCH_RENORMALIZE_WEIGHT) {
+                rescale(1.0 / weight);
+                landmark = timestamp;
+                weight = 1.0;
+            }
+        }
+
+        if (value > SKETCH_MIN_VALUE) {
+            positive.add(key(value), weight);
+        } else if (value < -SKETCH_MIN_VALUE) {
+            negative.add(key(-value), weight);
+        } else {
+            zero_weight += weight;
+        }
+        ++samples;
+    }
+
+    void merge(const QuantileSketch& other) {
+        if (other.samples == 0) {
+            return;
+        }
+        QuantileSketch aligned = other;
+        if (half_life > 0.0 && samples > 0 && other.landmark != landmark) {
+            // Leva as contagens do outro sketch para o mesmo referencial de tempo
+            aligned.rescale(std::exp2((other.landmark - landmark) / half_life));
+        } else if (samples == 0) {
+            landmark = other.landmark;
+        }
+        positive.merge(aligned.positive);
+        negative.merge(aligned.negative);
+        zero_weight += aligned.zero_weight;
+        samples += other.samples;
+    }
+
+    // Amostras recebidas (sem decaimento)
+    uint64_t count() const {
+        return samples;
+    }
+
+    double quantile(double q) const {
+        double total = negative.total() + zero_weight + positive.total();
+        if (total <= 0.0) {
+            return 0.0;
+        }
+        double rank = std::clamp(q, 0.0, 1.0) * total;
+        double seen = 0.0;
+        int last_bucket = 0;
+
+        // Dos negativos mais distantes de zero até os positivos maiores
+        auto visit = [&](int bucket, double count) {
+            seen += count;
+            last_bucket = bucket;
+            return seen >= rank;
+        };
+        if (negative.visit(false, visit)) {
+            return -value(last_bucket);
+        }
+        seen += zero_weight;
+        if (seen >= rank || positive.total() <= 0.0) {
+            return 0.0;
+        }
+        positive.visit(true, visit);
+        return value(last_bucket); // Arredondamentos podem deixar `rank` um pouco acima do total: fica o maior balde
+    }
+
+private:
+    static double gamma() {
+        return (1.0 + SKETCH_RELATIVE_ACCURACY) / (1.0 - SKETCH_RELATIVE_ACCURACY);
+    }
+
+    static int key(double magnitude) {
+        static const double log_gamma = std::log(gamma());
+        return static_cast<int>(std::ceil(std::log(magnitude) / log_gamma));
+    }
+
+    // Ponto do balde com erro relativo mínimo para todo o intervalo
+    static double value(int bucket) {
+        return 2.0 * std::pow(gamma(), bucket) / (gamma() + 1.0);
+    }
+
+    void rescale(double factor) {
+        positive.scale(factor);
+        negative.scale(factor);
+        zero_weight *= factor;
+    }
+
+    SketchStore positive;
+    SketchStore negative;
+    double zero_weight = 0.0;
+    uint64_t samples = 0;
+    double half_life;
+    std::time_t landmark = 0;
+};
+
+// CONFIGURAÇÃO --------------------------------------------------------------------------------------------
+
+// Critério para considerar uma amostra um outlier
+enum class OutlierMethod {
+    ZScore,   // |Z-score| na janela acima de zscore_threshold
+    Quantile  // fora da faixa [p(1 - outlier_quantile), p(outlier_quantile)] do sketch da série
+};
+
+// Parâmetros de processamento de um tipo de sensor
+struct SensorConfig {
+    size_t window = MOVING_AVERAGE_WINDOW; // Tamanho da janela da média móvel, Z-score e tendência
+    std::chrono::seconds inactivity_timeout{30}; // Atraso máximo entre duas leituras antes do alarme de inatividade
+    bool inactivity_timeout_set = false;         // Definido na configuração: prevalece sobre o intervalo anunciado
+    std::vector<std::chrono::seconds> rollups;   // Intervalos agregados (min/max/soma/contagem/último)
+    bool emit_raw = true;                        // false: só os agregados e os alarmes vão ao Graphite
+    OutlierMethod outlier_method = OutlierMethod::ZScore;
+    double zscore_threshold = 1.0;
+    double outlier_quantile = 0.999;
+    size_t quantile_min_samples = 100;           // Amostras antes de o método "quantile" gerar alarmes
+    std::chrono::seconds sketch_half_life{3600}; // Meia-vida do decaimento do sketch (0 = todo o histórico)
+    std::vector<double> quantiles;               // Quantis enviados ao Graphite (ex.: 0.5, 0.95, 0.99)
+    std::chrono::seconds quantiles_interval{60};
+
+    bool uses_sketch() const {
+        return !quantiles.empty();
+    }
+};
+
+// Tipos de regra de alarme
+enum class RuleKind {
+    Threshold,  // valor da amostra
+    Rate,       // variação por segundo desde a amostra anterior
+    ZScore,     // |Z-score| na janela da série
+    Percentile, // distância da amostra à faixa [p(1 - quantile), p(quantile)] do sketch
+    Absence     // nenhuma amostra há mais de for_s segundos
+};
+
+// Uma regra do arquivo de regras, já validada. O nome pode conter "{sensor}",
+// substituído pelo sensor ao qual a regra se aplica.
+struct AlarmRule {
+    std::string name;
+    std::string sensor = "*";  // "*" vale para todos os sensores
+    RuleKind kind = RuleKind::Threshold;
+    bool below = false;        // dispara abaixo do limite em vez de acima
+    double fire = 0.0;         // limite que dispara o alarme...
+    double clear = 0.0;        // ...e o que o limpa (histerese)
+    double quantile = 0.999;   // só para RuleKind::Percentile
+    std::chrono::seconds hold{0}; // tempo que a condição precisa durar (for_s)
+};
+
+// Divisão da frota entre várias instâncias do data_processor
+enum class Partitioning {
+    None,   // uma única instância recebe todas as máquinas
+    Shared, // assinatura compartilhada ($share/<grupo>/...): o broker distribui as mensagens
+    Hash    // hash consistente dos machine_ids entre as instâncias anunciadas em /data_processors/
+};
+
+// Comportamento quando a fila de um worker está cheia
+enum class QueueFullPolicy {
+    Block,      // a thread do MQTT espera até haver espaço
+    DropOldest  // a amostra mais antiga da fila é descartada
+};
+
+struct ProcessorConfig {
+    std::string mqtt_broker = BROKER_ADDRESS;
+    std::string mqtt_client_id;   // vazio: data-processor-<host>-<pid>
+    Partitioning partitioning = Partitioning::None;
+    std::string share_group = "data_processor";
+    std::string graphite_host = GRAPHITE_HOST;
+    int graphite_port = GRAPHITE_PORT;
+    std::string spill_directory = "/var/tmp/data_processor_spill"; // vazio desativa o spill em disco
+    size_t spill_segment_mb = 16;
+    size_t spill_max_mb = 256;
+    size_t spill_replay_rate = 5000; // linhas por segundo
+    int graphite_pickle_port = 2004;
+    std::string statsd_host = GRAPHITE_HOST;
+    int statsd_port = 8125;
+    std::vector<std::string> sinks = {"plaintext"}; // "plaintext", "pickle" e/ou "statsd"
+    SensorConfig default_sensor;
+    std::unordered_map<std::string, SensorConfig> sensors;
+    size_t workers = 0;           // 0 = número de threads de hardware
+    size_t queue_capacity = 4096; // Amostras por worker (arredondado para potência de 2)
+    QueueFullPolicy queue_full_policy = QueueFullPolicy::Block;
+    std::chrono::seconds stats_interval{10};                     // 0 desativa o envio ao Graphite
+    std::string stats_socket = "/var/tmp/data_processor.sock"; // vazio desativa o socket local
+    std::chrono::seconds fleet_interval{10};   // Agregados da frota (fleet.<sensor>.*); 0 desativa
+    size_t fleet_top_k = 5;
+    std::chrono::seconds fleet_stale_after{60}; // Máquinas sem leitura há mais tempo saem dos agregados
+    std::unordered_map<std::string, double> fleet_thresholds; // Limite por sensor para fleet.<sensor>.over_threshold
+    std::chrono::seconds history_retention{3600}; // Histórico comprimido em memória; 0 desativa
+    std::chrono::seconds history_block{600};      // Duração de cada bloco comprimido do histórico
+    bool announcements = true;    // Prepara as séries anunciadas em /sensor_monitors antes da primeira amostra
+    int64_t announced_missed_intervals = 10; // Prazo de inatividade: intervalos anunciados sem mensagem
+    std::string rules_file;       // vazio: alarmes de outlier e inatividade derivados de cada sensor
+    std::vector<AlarmRule> rules;
+    LogLevel log_level = LogLevel::Info;
+    std::chrono::seconds log_repeat_interval{10}; // Alarmes e avisos repetidos são agrupados neste intervalo
+
+    const SensorConfig& sensor(const std::string& sensor_id) const {
+        auto it = sensors.find(sensor_id);
+        return it != sensors.end() ? it->second : default_sensor;
+    }
+};
+
+ProcessorConfig config;
+
+SensorConfig parse_sensor_config(const nlohmann::json& j, const SensorConfig& defaults) {
+    SensorConfig sensor = defaults;
+    int64_t window = j.value("window", static_cast<int64_t>(sensor.window));
+    sensor.inactivity_timeout = std::chrono::seconds(j.value("inactivity_timeout_s", sensor.inactivity_timeout.count()));
+    sensor.inactivity_timeout_set = sensor.inactivity_timeout_set || j.contains("inactivity_timeout_s");
+    if (window <= 0 || window > MAX_WINDOW) {
+        throw std::invalid_argument("window must be between 1 and " + std::to_string(MAX_WINDOW));
+    }
+    sensor.window = static_cast<size_t>(window);
+    if (sensor.inactivity_timeout.count() <= 0) {
+        throw std::invalid_argument("inactivity_timeout_s must be greater than zero");
+    }
+    if (j.contains("rollups_s")) {
+        sensor.rollups.clear();
+        for (const auto& interval : j["rollups_s"]) {
+            if (interval.get<int64_t>() <= 0) {
+                throw std::invalid_argument("rollups_s intervals must be greater than zero");
+            }
+            sensor.rollups.emplace_back(interval.get<int64_t>());
+        }
+    }
+    sensor.emit_raw = j.value("emit_raw", sensor.emit_raw);
+    if (!sensor.emit_raw && sensor.rollups.empty()) {
+        throw std::invalid_argument("emit_raw can only be disabled when rollups_s is set");
+    }
+
+    if (j.contains("outlier_method")) {
+        std::string method = j["outlier_method"];
+        if (method == "zscore") {
+            sensor.outlier_method = OutlierMethod::ZScore;
+        } else if (method == "quantile") {
+            sensor.outlier_method = OutlierMethod::Quantile;
+        } else {
+            throw std::invalid_argument("outlier_method must be \"zscore\" or \"quantile\"");
+        }
+    }
+    sensor.zscore_threshold = j.value("zscore_threshold", sensor.zscore_threshold);
+    sensor.outlier_quantile = j.value("outlier_quantile", sensor.outlier_quantile);
+    if (sensor.outlier_quantile <= 0.5 || sensor.outlier_quantile >= 1.0) {
+        throw std::invalid_argument("outlier_quantile must be between 0.5 and 1");
+    }
+    sensor.quantile_min_samples = j.value("quantile_min_samples", sensor.quantile_min_samples);
+    sensor.sketch_half_life = std::chrono::seconds(j.value("sketch_half_life_s", sensor.sketch_half_life.count()));
+    if (j.contains("quantiles")) {
+        sensor.quantiles = j["quantiles"].get<std::vector<double>>();
+        for (double q : sensor.quantiles) {
+            if (q <= 0.0 || q >= 1.0) {
+                throw std::invalid_argument("quantiles must be between 0 and 1");
+            }
+        }
+    }
+    sensor.quantiles_interval = std::chrono::seconds(j.value("quantiles_interval_s", sensor.quantiles_interval.count()));
+    if (sensor.quantiles_interval.count() <= 0) {
+        throw std::invalid_argument("quantiles_interval_s must be greater than zero");
+    }
+    return sensor;
+}
+
+// Carrega o arquivo de regras de alarme (JSON). Exemplo:
+// { "rules": [
+//     { "name": "cpu_high", "sensor": "cpu_usage", "type": "threshold", "above": 90, "clear": 85, "for_s": 30 },
+//     { "name": "memory_low", "sensor": "memory_free", "type": "threshold", "below": 100, "clear": 150 },
+//     { "name": "temperature_rising", "sensor": "temperature", "type": "rate", "above": 0.5 },
+//     { "name": "{sensor}_outlier", "sensor": "*", "type": "zscore", "above": 3, "clear": 2 },
+//     { "name": "cpu_unusual", "sensor": "cpu_usage", "type": "percentile", "quantile": 0.999, "for_s": 10 },
+//     { "name": "inactive_{sensor}", "sensor": "*", "type": "absence", "for_s": 30 } ] }
+// Sem "clear", o alarme é limpo quando a condição deixa de valer.
+std::vector<AlarmRule> load_rules(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("could not open rules file " + path);
+    }
+    nlohmann::json j = nlohmann::json::parse(file);
+
+    static const std::unordered_map<std::string, RuleKind> kinds = {
+        {"threshold", RuleKind::Threshold}, {"rate", RuleKind::Rate}, {"zscore", RuleKind::ZScore},
+        {"percentile", RuleKind::Percentile}, {"absence", RuleKind::Absence}};
+    std::vector<AlarmRule> rules;
+    for (const nlohmann::json& r : j.at("rules")) {
+        AlarmRule rule;
+        rule.name = r.at("name").get<std::string>();
+        rule.sensor = r.value("sensor", rule.sensor);
+        auto kind = kinds.find(r.at("type").get<std::string>());
+        if (kind == kinds.end()) {
+            throw std::invalid_argument("rule " + rule.name + ": type must be threshold, rate, zscore, percentile or absence");
+        }
+        rule.kind = kind->second;
+        rule.hold = std::chrono::seconds(r.value("for_s", int64_t(0)));
+        if (rule.hold.count() < 0) {
+            throw std::invalid_argument("rule " + rule.name + ": for_s must not be negative");
+        }
+
+        switch (rule.kind) {
+        case RuleKind::Absence:
+            if (rule.hold.count() <= 0) {
+                throw std::invalid_argument("rule " + rule.name + ": absence rules need for_s");
+            }
+            break;
+        case RuleKind::Percentile:
+            rule.quantile = r.value("quantile", rule.quantile);
+            if (rule.quantile <= 0.5 || rule.quantile >= 1.0) {
+                throw std::invalid_argument("rule " + rule.name + ": quantile must be between 0.5 and 1");
+            }
+            break;
+        default:
+            if (r.contains("above") == r.contains("below")) {
+                throw std::invalid_argument("rule " + rule.name + ": set exactly one of above or below");
+            }
+            rule.below = r.contains("below");
+            rule.fire = r.at(rule.below ? "below" : "above").get<double>();
+            rule.clear = r.value("clear", rule.fire);
+            if (rule.below ? rule.clear < rule.fire : rule.clear > rule.fire) {
+                throw std::invalid_argument("rule " + rule.name + ": clear must be on the normal side of the limit");
+            }
+            break;
+        }
+        rules.push_back(std::move(rule));
+    }
+    return rules;
+}
+
+// Carrega o arquivo de configuração (JSON). Exemplo:
+// { "mqtt": { "broker": "tcp://localhost:1883", "client_id": "data-processor-1", "partitioning": "hash",
+//             "share_group": "data_processor" },
+//   "sinks": ["plaintext"],
+//   "graphite": { "host": "graphite", "port": 2003, "pickle_port": 2004,
+//                 "spill": { "directory": "/var/tmp/data_processor_spill", "segment_mb": 16, "max_mb": 256,
+//                            "replay_rate": 5000 } },
+//   "statsd": { "host": "graphite", "port": 8125 },
+//   "stats_interval_s": 10, "stats_socket": "/var/tmp/data_processor.sock",
+//   "log_level": "warn", "log_repeat_interval_s": 10, "rules_file": "alarm_rules.json",
+//   "history": { "retention_s": 3600, "block_s": 600 },
+//   "fleet": { "interval_s": 10, "top_k": 5, "stale_after_s": 60, "thresholds": { "cpu_usage": 90 } },
+//   "announcements": { "enabled": true, "missed_intervals": 10 },
+//   "workers": 4, "queue_capacity": 4096, "queue_full_policy": "drop_oldest",
+//   "default_sensor": { "window": 5, "inactivity_timeout_s": 30, "rollups_s": [10, 60, 600],
+//                       "outlier_method": "quantile", "outlier_quantile": 0.999, "sketch_half_life_s": 3600,
+//                       "quantiles": [0.5, 0.95, 0.99], "quantiles_interval_s": 60 },
+//   "sensors": { "cpu_usage": { "window": 1000, "inactivity_timeout_s": 50, "emit_raw": false } } }
+void load_config(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("could not open config file " + path);
+    }
+    nlohmann::json j = nlohmann::json::parse(file);
+
+    if (j.contains("mqtt")) {
+        const nlohmann::json& mqtt = j["mqtt"];
+        config.mqtt_broker = mqtt.value("broker", config.mqtt_broker);
+        config.mqtt_client_id = mqtt.value("client_id", config.mqtt_client_id);
+        config.share_group = mqtt.value("share_group", config.share_group);
+        std::string partitioning = mqtt.value("partitioning", std::string("none"));
+        if (partitioning == "none") {
+            config.partitioning = Partitioning::None;
+        } else if (partitioning == "shared") {
+            config.partitioning = Partitioning::Shared;
+        } else if (partitioning == "hash") {
+            config.partitioning = Partitioning::Hash;
+        } else {
+            throw std::invalid_argument("mqtt partitioning must be \"none\", \"shared\" or \"hash\"");
+        }
+        if (config.share_group.empty() || config.share_group.find_first_of("/+#") != std::string::npos) {
+            throw std::invalid_argument("mqtt share_group must be a non-empty name without '/', '+' or '#'");
+        }
+    }
+
+    if (j.contains("graphite")) {
+        const nlohmann::json& graphite = j["graphite"];
+        config.graphite_host = graphite.value("host", config.graphite_host);
+        config.graphite_port = graphite.value("port", config.graphite_port);
+        config.graphite_pickle_port = graphite.value("pickle_port", config.graphite_pickle_port);
+        if (graphite.contains("spill")) {
+            const nlohmann::json& spill = graphite["spill"];
+            config.spill_directory = spill.value("directory", config.spill_directory);
+            config.spill_segment_mb = spill.value("segment_mb", config.spill_segment_mb);
+            config.spill_max_mb = spill.value("max_mb", config.spill_max_mb);
+            config.spill_replay_rate = spill.value("replay_rate", config.spill_replay_rate);
+            if (config.spill_segment_mb == 0 || config.spill_max_mb < config.spill_segment_mb) {
+                throw std::invalid_argument("spill max_mb must be at least segment_mb");
+            }
+        }
+    }
+
+    if (j.contains("statsd")) {
+        config.statsd_host = j["statsd"].value("host", config.statsd_host);
+        config.statsd_port = j["statsd"].value("port", config.statsd_port);
+    }
+    config.sinks = j.value("sinks", config.sinks);
+    for (const std::string& sink : config.sinks) {
+        if (sink != "plaintext" && sink != "pickle" && sink != "statsd") {
+            throw std::invalid_argument("sinks must be \"plaintext\", \"pickle\" or \"statsd\"");
+        }
+    }
+
+    config.stats_interval = std::chrono::seconds(j.value("stats_interval_s", config.stats_interval.count()));
+    config.stats_socket = j.value("stats_socket", config.stats_socket);
+    if (j.contains("history")) {
+        const nlohmann::json& history = j["history"];
+        config.history_retention = std::chrono::seconds(history.value("retention_s", config.history_retention.count()));
+        config.history_block = std::chrono::seconds(history.value("block_s", config.history_block.count()));
+        if (config.history_retention.count() < 0 || config.history_block.count() <= 0) {
+            throw std::invalid_argument("history retention_s must not be negative and block_s must be positive");
+        }
+    }
+    if (j.contains("fleet")) {
+        const nlohmann::json& fleet = j["fleet"];
+        config.fleet_interval = std::chrono::seconds(fleet.value("interval_s", config.fleet_interval.count()));
+        config.fleet_top_k = fleet.value("top_k", config.fleet_top_k);
+        config.fleet_stale_after = std::chrono::seconds(fleet.value("stale_after_s", config.fleet_stale_after.count()));
+        if (fleet.contains("thresholds")) {
+            config.fleet_thresholds = fleet["thresholds"].get<std::unordered_map<std::string, double>>();
+        }
+        if (config.fleet_interval.count() < 0 || config.fleet_stale_after.count() <= 0) {
+            throw std::invalid_argument("fleet interval_s and stale_after_s must be positive");
+        }
+    }
+    if (j.contains("announcements")) {
+        const nlohmann::json& announcements = j["announcements"];
+        config.announcements = announcements.value("enabled", config.announcements);
+        config.announced_missed_intervals = announcements.value("missed_intervals", config.announced_missed_intervals);
+        if (config.announced_missed_intervals <= 0) {
+            throw std::invalid_argument("announcements missed_intervals must be greater than zero");
+        }
+    }
+    if (j.contains("log_level") && !parse_log_level(j["log_level"].get<std::string>(), config.log_level)) {
+        throw std::invalid_argument("log_level must be debug, info, warn, error or off");
+    }
+    config.log_repeat_interval = std::chrono::seconds(j.value("log_repeat_interval_s", config.log_repeat_interval.count()));
+    config.rules_file = j.value("rules_file", config.rules_file);
+    if (!config.rules_file.empty()) {
+        config.rules = load_rules(config.rules_file);
+    }
+
+    config.workers = j.value("workers", config.workers);
+    config.queue_capacity = j.value("queue_capacity", config.queue_capacity);
+    if (config.queue_capacity == 0) {
+        throw std::invalid_argument("queue_capacity must be greater than zero");
+    }
+    std::string policy = j.value("queue_full_policy", std::string("block"));
+    if (policy == "block") {
+        config.queue_full_policy = QueueFullPolicy::Block;
+    } else if (policy == "drop_oldest") {
+        config.queue_full_policy = QueueFullPolicy::DropOldest;
+    } else {
+        throw std::invalid_argument("queue_full_policy must be \"block\" or \"drop_oldest\"");
+    }
+
+    if (j.contains("default_sensor")) {
+        config.default_sensor = parse_sensor_config(j["default_sensor"], config.default_sensor);
+    }
+    if (j.contains("sensors")) {
+        for (const auto& [sensor_id, sensor_json] : j["sensors"].items()) {
+            config.sensors[sensor_id] = parse_sensor_config(sensor_json, config.default_sensor);
+        }
+    }
+}
+
+// REGRAS DE ALARME ----------------------------------------------------------------------------------------
+
+// Sinais calculados a cada amostra e comparados pelas regras. Os sinais de faixa
+// de quantis vêm depois de SIGNAL_BANDS, um por quantil distinto usado pelas regras.
+#define SIGNAL_VALUE 0
+#define SIGNAL_RATE 1
+#define SIGNAL_ZSCORE 2
+#define SIGNAL_BANDS 3
+
+// Regra avaliada a cada amostra. O sentido já vem aplicado aos limites, de modo
+// que a avaliação é sempre "direction * sinal > fire" para disparar e
+// "direction * sinal <= clear" para limpar.
+struct CompiledRule {
+    uint32_t signal;
+    double direction; // +1 (acima) ou -1 (abaixo)
+    double fire;
+    double clear;
+    std::time_t hold;
+    std::string name;   // nome com {sensor} já substituído
+    std::string metric; // alarms.<nome>
+};
+
+// Plano de avaliação de um tipo de sensor: a tabela plana das regras que se
+// aplicam a ele, montada uma vez e compartilhada por todas as suas séries
+struct RulePlan {
+    std::vector<CompiledRule> rules;
+    std::vector<double> band_quantiles; // quantis das faixas usadas por regras "percentile"
+    bool uses_rate = false;
+    bool uses_zscore = false;
+    std::chrono::seconds absence{0};    // 0: sem alarme de inatividade
+    bool absence_follows_announcement = false; // prazo padrão: o intervalo anunciado pelo sensor o substitui
+    std::string absence_name;
+    std::string absence_metric;
+
+    size_t signal_count() const {
+        return SIGNAL_BANDS + band_quantiles.size();
+    }
+};
+
+// Compila as regras para cada tipo de sensor na primeira vez que ele aparece.
+// Sem arquivo de regras, cada sensor recebe as regras equivalentes à sua
+// configuração: outlier por Z-score ou quantis e inatividade.
+class RuleBook {
+public:
+    const RulePlan& plan(const std::string& sensor_id) {
+        std::lock_guard<std::mutex> lock(plans_mtx);
+        std::unique_ptr<RulePlan>& plan = plans[sensor_id];
+        if (!plan) {
+            plan = std::make_unique<RulePlan>(compile(sensor_id));
+        }
+        return *plan;
+    }
+
+private:
+    static std::vector<AlarmRule> default_rules(const SensorConfig& sensor) {
+        AlarmRule outlier;
+        outlier.name = "{sensor}_outlier";
+        if (sensor.outlier_method == OutlierMethod::Quantile) {
+            outlier.kind = RuleKind::Percentile;
+            outlier.quantile = sensor.outlier_quantile;
+        } else {
+            outlier.kind = RuleKind::ZScore;
+            outlier.fire = outlier.clear = sensor.zscore_threshold;
+        }
+
+        AlarmRule inactive;
+        inactive.name = "inactive_{sensor}";
+        inactive.kind = RuleKind::Absence;
+        inactive.hold = sensor.inactivity_timeout;
+        return {outlier, inactive};
+    }
+
+    static RulePlan compile(const std::string& sensor_id) {
+        const std::vector<AlarmRule>& rules =
+            config.rules_file.empty() ? default_rules(config.sensor(sensor_id)) : config.rules;
+        RulePlan plan;
+        for (const AlarmRule& rule : rules) {
+            if (rule.sensor != "*" && rule.sensor != sensor_id) {
+                continue;
+            }
+            std::string name = rule.name;
+            for (size_t pos = name.find("{sensor}"); pos != std::string::npos; pos = name.find("{sensor}")) {
+                name.replace(pos, 8, sensor_id);
+            }
+
+            if (rule.kind == RuleKind::Absence) {
+                // Uma série tem um único prazo de inatividade: vale a última regra
+                plan.absence = rule.hold;
+                plan.absence_follows_announcement =
+                    config.rules_file.empty() && !config.sensor(sensor_id).inactivity_timeout_set;
+                plan.absence_name = name;
+                plan.absence_metric = "alarms." + name;
+                continue;
+            }
+
+            CompiledRule compiled;
+            compiled.direction = rule.below ? -1.0 : 1.0;
+            compiled.fire = compiled.direction * rule.fire;
+            compiled.clear = compiled.direction * rule.clear;
+            compiled.hold = rule.hold.count();
+            switch (rule.kind) {
+            case RuleKind::Threshold:
+                compiled.signal = SIGNAL_VALUE;
+                break;
+            case RuleKind::Rate:
+                compiled.signal = SIGNAL_RATE;
+                plan.uses_rate = true;
+                break;
+            case RuleKind::ZScore:
+                compiled.signal = SIGNAL_ZSCORE;
+                plan.uses_zscore = true;
+                break;
+            default: {
+                // O sinal é a distância até a faixa: positivo fora dela
+                auto band = std::find(plan.band_quantiles.begin(), plan.band_quantiles.end(), rule.quantile);
+                compiled.signal = SIGNAL_BANDS + static_cast<uint32_t>(band - plan.band_quantiles.begin());
+                if (band == plan.band_quantiles.end()) {
+                    plan.band_quantiles.push_back(rule.quantile);
+                }
+                compiled.fire = compiled.clear = 0.0;
+                break;
+            }
+            }
+            compiled.name = name;
+            compiled.metric = "alarms." + name;
+            plan.rules.push_back(std::move(compiled));
+        }
+        return plan;
+    }
+
+    std::mutex plans_mtx;
+    std::unordered_map<std::string, std::unique_ptr<RulePlan>> plans;
+};
+
+RuleBook rule_book;
+
+// INSTRUMENTAÇÃO -------------------------------------------------------------------------------------------
+
+// Histograma de latências com baldes log-lineares (como o HdrHistogram): cada
+// potência de 2 é dividida em 2^HISTOGRAM_SUB_BUCKET_BITS baldes, o que dá erro
+// relativo de até 1/16. Registrar é um único incremento atômico, sem trava.
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+int64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class LatencyHistogram {
+public:
+    struct Snapshot {
+        std::array<uint64_t, HISTOGRAM_BUCKETS> counts{};
+        uint64_t total = 0;
+
+        // Valor (em ns) abaixo do qual está a fração p das amostras
+        uint64_t percentile(double p) const {
+            uint64_t rank = static_cast<uint64_t>(std::ceil(p * total));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                seen += counts[i];
+                if (seen >= rank && counts[i] > 0) {
+                    return bucket_value(i);
+                }
+            }
+            return 0;
+        }
+
+        uint64_t max() const {
+            for (size_t i = counts.size(); i-- > 0;) {
+                if (counts[i] > 0) {
+                    return bucket_value(i);
+                }
+            }
+            return 0;
+        }
+
+        // Amostras registradas desde o snapshot anterior
+        Snapshot since(const Snapshot& previous) const {
+            Snapshot delta;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                delta.counts[i] = counts[i] - previous.counts[i];
+            }
+            delta.total = total - previous.total;
+            return delta;
+        }
+    };
+
+    void record(int64_t nanoseconds) {
+        counts[bucket_index(nanoseconds > 0 ? static_cast<uint64_t>(nanoseconds) : 0)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Snapshot snapshot() const {
+        Snapshot result;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            result.counts[i] = counts[i].load(std::memory_order_relaxed);
+            result.total += result.counts[i];
+        }
+        return result;
+    }
+
+private:
+    static size_t bucket_index(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return static_cast<size_t>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        size_t sub_bucket = (value >> (msb - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        return static_cast<size_t>(msb - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+    }
+
+    // Meio do intervalo coberto pelo balde
+    static uint64_t bucket_value(size_t index) {
+        if (index < HISTOGRAM_SUB_BUCKETS) {
+            return index;
+        }
+        int msb = static_cast<int>(index / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BUCKET_BITS - 1;
+        uint64_t width = uint64_t(1) << (msb - HISTOGRAM_SUB_BUCKET_BITS);
+        uint64_t lower = (uint64_t(1) << msb) | ((index % HISTOGRAM_SUB_BUCKETS) * width);
+        return lower + width / 2;
+    }
+
+    std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS> counts{};
+};
+
+// Contadores e latências do próprio data_processor, por etapa:
+//   decode        chegada da mensagem MQTT -> leitura decodificada
+//   queue_wait    leitura decodificada -> início do processamento no worker
+//   process       cálculo das estatísticas e formatação das métricas
+//   graphite_flush linha mais antiga de um lote enfileirada -> lote escrito no socket
+//   lock_wait     espera pela trava da fila do Graphite (só quando disputada)
+//   backpressure  espera por espaço na fila de um worker cheio (política "block")
+struct ProcessorStats {
+    std::atomic<uint64_t> messages_received{0};
+    std::atomic<uint64_t> decode_errors{0};
+    std::atomic<uint64_t> messages_skipped{0}; // de máquinas atendidas por outra instância
+    std::atomic<uint64_t> announcements_received{0}; // mensagens de /sensor_monitors
+    std::atomic<uint64_t> series_provisioned{0};     // séries criadas por um anúncio, antes da primeira amostra
+    std::atomic<uint64_t> samples_processed{0};
+    std::atomic<uint64_t> metrics_posted{0};
+    std::atomic<uint64_t> graphite_lines_sent{0};
+    std::atomic<uint64_t> graphite_lines_spilled{0};
+    std::atomic<uint64_t> statsd_lines_sent{0};
+    std::atomic<uint64_t> statsd_send_errors{0};     // datagramas recusados pelo send
+    std::atomic<uint64_t> statsd_paths_rejected{0};  // métricas com caminho maior que STATSD_PATH_MAX_BYTES
+
+    LatencyHistogram decode;
+    LatencyHistogram queue_wait;
+    LatencyHistogram process;
+    LatencyHistogram graphite_flush;
+    LatencyHistogram lock_wait;
+    LatencyHistogram backpressure;
+};
+
+ProcessorStats processor_stats;
+
+// POSTAR MÉTRICA ------------------------------------------------------------------------------------------
+
+#define GRAPHITE_FLUSH_INTERVAL_MS 1000   // Intervalo máximo entre dois envios em lote
+#define GRAPHITE_BATCH_BYTES (64 * 1024)  // Volume enfileirado que antecipa o envio do lote
+#define GRAPHITE_QUEUE_CAPACITY 100000    // Máximo de linhas na fila (as mais antigas são descartadas)
+#define GRAPHITE_FRAME_METRICS 500        // Métricas por escrita (linhas plaintext ou lista pickle)
+#define STATSD_DATAGRAM_BYTES 1432        // Cabe num quadro Ethernet sem fragmentar
+#define STATSD_PATH_MAX_BYTES 216         // Caminhos maiores são recusados (cortá-los juntaria séries distintas)
+#define GRAPHITE_BACKOFF_MIN_MS 100       // Espera inicial antes de tentar reconectar
+#define GRAPHITE_BACKOFF_MAX_MS 30000     // Espera máxima entre tentativas de reconexão
+
+// Uma métrica a enviar: caminho completo, timestamp e valor
+struct Metric {
+    std::string path;
+    std::time_t timestamp;
+    double value;
+};
+
+// Escreve o valor em out (ao menos 32 bytes) e devolve o fim. Sem std::to_chars
+// para double (libstdc++ anterior ao GCC 11), usa snprintf.
+char* format_value(char* out, double value) {
+#if defined(__cpp_lib_to_chars)
+    return std::to_chars(out, out + 32, value).ptr;
+#else
+    return out + std::snprintf(out, 32, "%.15g", value);
+#endif
+}
+
+// "<caminho> <valor> <timestamp>\n" (plaintext do Graphite)
+void append_plaintext(std::string& out, const Metric& metric) {
+    char number[64];
+    out += metric.path;
+    out += ' ';
+    out.append(number, format_value(number, metric.value));
+    out += ' ';
+    out.append(number, std::to_chars(number, number + sizeof(number), metric.timestamp).ptr);
+    out += '\n';
+}
+
+// Valor em ponto flutuante no pickle: opcode BINFLOAT e 8 bytes big-endian
+void append_pickle_float(std::string& out, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    bits = htobe64(bits);
+    out += 'G';
+    out.append(reinterpret_cast<const char*>(&bits), sizeof(bits));
+}
+
+// Lista pickle (protocolo 2) [(caminho, (timestamp, valor)), ...] precedida do
+// tamanho em 4 bytes big-endian, como espera o receptor pickle do carbon (porta 2004)
+template <typename Metrics>
+void append_pickle_frame(std::string& out, const Metrics& metrics, size_t begin, size_t end) {
+    size_t header = out.size();
+    out.append(4, '\0');
+    out += "\x80\x02]("; // PROTO 2, EMPTY_LIST, MARK
+    for (size_t i = begin; i < end; ++i) {
+        const Metric& metric = metrics[i];
+        uint32_t path_size = htole32(static_cast<uint32_t>(metric.path.size()));
+        out += 'X'; // BINUNICODE
+        out.append(reinterpret_cast<const char*>(&path_size), sizeof(path_size));
+        out += metric.path;
+        append_pickle_float(out, static_cast<double>(metric.timestamp));
+        append_pickle_float(out, metric.value);
+        out += "\x86\x86"; // TUPLE2 (timestamp, valor), TUPLE2 (caminho, ...)
+    }
+    out += "e."; // APPENDS, STOP
+    uint32_t length = htobe32(static_cast<uint32_t>(out.size() - header - 4));
+    std::memcpy(&out[header], &length, sizeof(length));
+}
+
+// Destino das métricas. post() é chamado pelas threads de processamento e não
+// deve bloquear na rede.
+class MetricSink {
+public:
+    virtual ~MetricSink() = default;
+    virtual void post(Metric metric) = 0;
+    virtual void stop() = 0;
+    virtual size_t backlog() = 0; // métricas aguardando envio
+};
+
+// Conexão TCP com o Graphite, reaberta com backoff exponencial quando cai. Usada
+// por uma única thread de cada vez.
+class GraphiteConnection {
+public:
+    GraphiteConnection(const std::string& host, int port) : host(host), port(port) {}
+
+    ~GraphiteConnection() {
+        disconnect();
+    }
+
+    GraphiteConnection(const GraphiteConnection&) = delete;
+    GraphiteConnection& operator=(const GraphiteConnection&) = delete;
+
+    // Conecta se necessário; retorna false enquanto o Graphite estiver inacessível
+    bool ensure_connected() {
+        if (graphite_socket != -1) {
+            return true;
+        }
+        if (std::chrono::steady_clock::now() < next_connect_attempt) {
+            return false;
+        }
+
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* addresses = nullptr;
+        std::string port_str = std::to_string(port);
+        if (getaddrinfo(host.c_str(), port_str.c_str(), &hints, &addresses) != 0) {
+            log_text(LogLevel::Error, "Error: Invalid address or address not supported");
+            schedule_reconnect();
+            return false;
+        }
+
+        for (struct addrinfo* addr = addresses; addr != nullptr; addr = addr->ai_next) {
+            int s = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (s == -1) {
+                continue;
+            }
+            if (connect(s, addr->ai_addr, addr->ai_addrlen) == 0) {
+                graphite_socket = s;
+                break;
+            }
+            close(s);
+        }
+        freeaddrinfo(addresses);
+
+        if (graphite_socket == -1) {
+            log_text(LogLevel::Error, "Error: Failed to connect to Graphite");
+            schedule_reconnect();
+            return false;
+        }
+
+        // Evita que a thread fique presa indefinidamente se o Graphite parar de ler
+        struct timeval timeout = {5, 0};
+        setsockopt(graphite_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        backoff = std::chrono::milliseconds(GRAPHITE_BACKOFF_MIN_MS);
+        return true;
+    }
+
+    // Escreve as linhas com o menor número possível de chamadas de sistema. Em caso
+    // de falha, sent_lines indica quantas linhas completas já foram entregues; uma
+    // linha enviada pela metade é reenviada inteira na próxima conexão.
+    template <typename Lines>
+    bool write_lines(const Lines& lines, size_t& sent_lines) {
+        std::vector<struct iovec> iov;
+        iov.reserve(std::min<size_t>(lines.size(), IOV_MAX));
+        size_t line_offset = 0; // bytes já enviados da primeira linha pendente
+
+        while (sent_lines < lines.size()) {
+            iov.clear();
+            for (size_t i = sent_lines; i < lines.size() && iov.size() < IOV_MAX; ++i) {
+                size_t skip = (i == sent_lines) ? line_offset : 0;
+                iov.push_back({const_cast<char*>(lines[i].data()) + skip, lines[i].size() - skip});
+            }
+
+            struct msghdr msg = {};
+            msg.msg_iov = iov.data();
+            msg.msg_iovlen = iov.size();
+            ssize_t written = sendmsg(graphite_socket, &msg, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+
+            // Avança sobre as linhas completamente escritas
+            size_t remaining = static_cast<size_t>(written);
+            while (remaining > 0) {
+                size_t left_in_line = lines[sent_lines].size() - line_offset;
+                if (remaining < left_in_line) {
+                    line_offset += remaining;
+                    break;
+                }
+                remaining -= left_in_line;
+                line_offset = 0;
+                ++sent_lines;
+            }
+        }
+        return true;
+    }
+
+    // Descarta a conexão após um erro de envio
+    void fail() {
+        disconnect();
+        schedule_reconnect();
+    }
+
+    void disconnect() {
+        if (graphite_socket != -1) {
+            close(graphite_socket);
+            graphite_socket = -1;
+        }
+    }
+
+private:
+    void schedule_reconnect() {
+        next_connect_attempt = std::chrono::steady_clock::now() + backoff;
+        backoff = std::min(backoff * 2, std::chrono::milliseconds(GRAPHITE_BACKOFF_MAX_MS));
+    }
+
+    std::string host;
+    int port;
+    int graphite_socket = -1;
+    std::chrono::milliseconds backoff{GRAPHITE_BACKOFF_MIN_MS};
+    std::chrono::steady_clock::time_point next_connect_attempt;
+};
+
+// Log de linhas que não puderam ser entregues ao Graphite, gravado em segmentos
+// de tamanho fixo mapeados em memória (segment-<n>.log) num diretório. Só se
+// acrescenta no fim; o cursor de reenvio (segmento, posição) fica no arquivo
+// "cursor" e é sincronizado com o disco a cada avanço, de modo que um reinício
+// continua de onde parou. Ao ultrapassar o limite de segmentos, o mais antigo é
+// descartado. As linhas não contêm '\0', então o fim de um segmento é o primeiro
+// byte nulo. O diretório fica travado (flock em "lock") enquanto o log está
+// aberto: duas instâncias no mesmo diretório sobrescreveriam os dados uma da outra.
+class SpillLog {
+public:
+    struct Cursor {
+        uint64_t segment = 0;
+        uint64_t offset = 0;
+    };
+
+    ~SpillLog() {
+        for (Segment& segment : segments) {
+            munmap(segment.data, segment_size);
+        }
+        if (cursor_fd != -1) {
+            close(cursor_fd);
+        }
+        if (lock_fd != -1) {
+            close(lock_fd);
+        }
+    }
+
+    bool open(const std::string& dir, size_t segment_bytes, size_t max_segment_count) {
+        directory = dir;
+        segment_size = segment_bytes;
+        max_segments = std::max<size_t>(max_segment_count, 2);
+
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        lock_fd = ::open((directory + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock_fd != -1 && flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+            directory_in_use = errno == EWOULDBLOCK;
+            std::cerr << "Error: Could not lock spill directory " << directory << ": "
+                      << (directory_in_use ? "in use by another process" : std::strerror(errno)) << "\n";
+            return false;
+        }
+        std::vector<uint64_t> existing;
+        for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+            unsigned long long number;
+            if (std::sscanf(entry.path().filename().c_str(), "segment-%llu.log", &number) == 1) {
+                existing.push_back(number);
+            }
+        }
+        if (error) {
+            std::cerr << "Error: Could not open spill directory " << directory << ": " << error.message() << "\n";
+            return false;
+        }
+        std::sort(existing.begin(), existing.end());
+        for (uint64_t number : existing) {
+            if (!map_segment(number)) {
+                return false;
+            }
+        }
+
+        cursor_fd = ::open((directory + "/cursor").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (cursor_fd == -1) {
+            std::cerr << "Error: Could not open spill cursor: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        if (pread(cursor_fd, &cursor, sizeof(cursor), 0) != sizeof(cursor)) {
+            cursor = Cursor{};
+        }
+        if (!segments.empty() && cursor.segment < segments.front().number) {
+            cursor = Cursor{segments.front().number, 0};
+        }
+        if (has_backlog()) {
+            std::clog << "Graphite spill log has " << backlog_bytes() << " bytes waiting to be replayed" << std::endl;
+        }
+        return true;
+    }
+
+    void append(const std::string& line) {
+        std::lock_guard<std::mutex> lock(spill_mtx);
+        if (line.size() > segment_size) {
+            return;
+        }
+        if (segments.empty() || segments.back().write_offset + line.size() > segment_size) {
+            uint64_t number = segments.empty() ? cursor.segment : segments.back().number + 1;
+            if (!map_segment(number)) {
+                ++dropped_lines;
+                return;
+            }
+            while (segments.size() > max_segments) {
+                drop_oldest_segment();
+            }
+        }
+        Segment& segment = segments.back();
+        std::memcpy(segment.data + segment.write_offset, line.data(), line.size());
+        segment.write_offset += line.size();
+    }
+
+    // Copia até max_lines linhas a partir do cursor; `next` é a posição logo após elas
+    size_t read(std::vector<std::string>& lines, size_t max_lines, Cursor& next) {
+        std::lock_guard<std::mutex> lock(spill_mtx);
+        lines.clear();
+        next = cursor;
+        for (const Segment& segment : segments) {
+            if (segment.number < next.segment) {
+                continue;
+            }
+            if (segment.number > next.segment) {
+                next = Cursor{segment.number, 0};
+            }
+            while (next.offset < segment.write_offset && lines.size() < max_lines) {
+                const char* start = segment.data + next.offset;
+                const char* newline = static_cast<const char*>(std::memchr(start, '\n', segment.write_offset - next.offset));
+                size_t length = newline ? static_cast<size_t>(newline - start) + 1 : segment.write_offset - next.offset;
+                lines.emplace_back(start, length);
+                next.offset += length;
+            }
+            if (lines.size() >= max_lines) {
+                break;
+            }
+        }
+        return lines.size();
+    }
+
+    // Marca como entregue tudo o que vem antes de `next`, apagando os segmentos já reenviados
+    void commit(const Cursor& next) {
+        std::lock_guard<std::mutex> lock(spill_mtx);
+        if (next.segment > cursor.segment || (next.segment == cursor.segment && next.offset > cursor.offset)) {
+            cursor = next;
+        }
+        while (segments.size() > 1 && segments.front().number < cursor.segment) {
+            unmap_front();
+        }
+        // Os dados vão para o disco antes do cursor: após uma queda de energia o
+        // cursor gravado nunca aponta para além do que os segmentos guardam
+        sync_segments();
+        if (pwrite(cursor_fd, &cursor, sizeof(cursor), 0) == sizeof(cursor)) {
+            fdatasync(cursor_fd);
+        }
+    }
+
+    bool has_backlog() const {
+        return backlog_bytes() > 0;
+    }
+
+    // open falhou porque outra instância está usando o diretório
+    bool in_use() const {
+        return directory_in_use;
+    }
+
+    size_t backlog_bytes() const {
+        std::lock_guard<std::mutex> lock(spill_mtx);
+        size_t bytes = 0;
+        for (const Segment& segment : segments) {
+            if (segment.number > cursor.segment) {
+                bytes += segment.write_offset;
+            } else if (segment.number == cursor.segment && segment.write_offset > cursor.offset) {
+                bytes += segment.write_offset - cursor.offset;
+            }
+        }
+        return bytes;
+    }
+
+    size_t take_dropped() {
+        std::lock_guard<std::mutex> lock(spill_mtx);
+        return std::exchange(dropped_lines, 0);
+    }
+
+private:
+    struct Segment {
+        uint64_t number;
+        char* data;
+        size_t write_offset;
+        size_t synced_offset; // até onde o segmento já foi gravado no disco com msync
+    };
+
+    // Grava no disco o que foi acrescentado desde a última sincronização
+    void sync_segments() {
+        static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        for (Segment& segment : segments) {
+            if (segment.write_offset <= segment.synced_offset) {
+                continue;
+            }
+            size_t start = segment.synced_offset - segment.synced_offset % page_size;
+            if (msync(segment.data + start, segment.write_offset - start, MS_SYNC) == 0) {
+                segment.synced_offset = segment.write_offset;
+            }
+        }
+    }
+
+    std::string segment_path(uint64_t number) const {
+        char name[48];
+        std::snprintf(name, sizeof(name), "/segment-%020llu.log", static_cast<unsigned long long>(number));
+        return directory + name;
+    }
+
+    bool map_segment(uint64_t number) {
+        std::string path = segment_path(number);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1 || ftruncate(fd, static_cast<off_t>(segment_size)) == -1) {
+            std::cerr << "Error: Could not create spill segment " << path << ": " << std::strerror(errno) << "\n";
+            if (fd != -1) {
+                close(fd);
+            }
+            return false;
+        }
+        void* data = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            std::cerr << "Error: Could not map spill segment " << path << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+        char* bytes = static_cast<char*>(data);
+        size_t written = strnlen(bytes, segment_size);
+        segments.push_back({number, bytes, written, written});
+        return true;
+    }
+
+    void unmap_front() {
+        munmap(segments.front().data, segment_size);
+        unlink(segment_path(segments.front().number).c_str());
+        segments.pop_front();
+    }
+
+    void drop_oldest_segment() {
+        const Segment& oldest = segments.front();
+        if (cursor.segment <= oldest.number) {
+            dropped_lines += static_cast<size_t>(std::count(oldest.data + (cursor.segment == oldest.number ? cursor.offset : 0),
+                                                            oldest.data + oldest.write_offset, '\n'));
+            cursor = Cursor{oldest.number + 1, 0};
+        }
+        unmap_front();
+    }
+
+    std::string directory;
+    size_t segment_size = 0;
+    size_t max_segments = 0;
+    std::deque<Segment> segments; // do mais antigo para o mais novo
+    Cursor cursor;
+    int cursor_fd = -1;
+    int lock_fd = -1;
+    bool directory_in_use = false;
+    size_t dropped_lines = 0;
+    mutable std::mutex spill_mtx;
+};
+
+// Reenvia o conteúdo do SpillLog ao Graphite por uma conexão própria, limitado a
+// `rate` linhas por segundo para não competir com o tráfego ao vivo.
+class SpillReplayer {
+public:
+    ~SpillReplayer() {
+        stop();
+    }
+
+    void start(const std::string& graphite_host, int graphite_port, SpillLog& spill_log, size_t lines_per_second) {
+        host = graphite_host;
+        port = graphite_port;
+        log = &spill_log;
+        rate = std::max<size_t>(lines_per_second, 1);
+        running = true;
+        replay_thread = std::thread(&SpillReplayer::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(replay_mtx);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        replay_cv.notify_one();
+        if (replay_thread.joinable()) {
+            replay_thread.join();
+        }
+    }
+
+private:
+    void run() {
+        const auto step = std::chrono::milliseconds(100);
+        const size_t lines_per_step = std::max<size_t>(rate / 10, 1);
+        GraphiteConnection connection(host, port);
+        std::vector<std::string> lines;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(replay_mtx);
+                replay_cv.wait_for(lock, log->has_backlog() ? step : std::chrono::milliseconds(1000), [this] {
+                    return !running;
+                });
+                if (!running) {
+                    return;
+                }
+            }
+
+            size_t dropped = log->take_dropped();
+            if (dropped > 0) {
+                log_text(LogLevel::Warn, "Warning: Graphite spill log full, ", dropped, " metric(s) discarded");
+            }
+            if (!log->has_backlog() || !connection.ensure_connected()) {
+                continue;
+            }
+
+            SpillLog::Cursor next;
+            if (log->read(lines, lines_per_step, next) == 0) {
+                continue;
+            }
+            size_t sent_lines = 0;
+            if (connection.write_lines(lines, sent_lines)) {
+                log->commit(next);
+            } else {
+                connection.fail(); // o trecho é reenviado por inteiro; o Graphite sobrescreve pontos repetidos
+            }
+        }
+    }
+
+    std::string host;
+    int port = 0;
+    SpillLog* log = nullptr;
+    size_t rate = 1;
+    std::mutex replay_mtx;
+    std::condition_variable replay_cv;
+    bool running = false;
+    std::thread replay_thread;
+};
+
+// Formato usado por um GraphiteSender
+enum class GraphiteProtocol {
+    Plaintext, // linhas "<caminho> <valor> <timestamp>", porta 2003
+    Pickle     // listas pickle em lote, porta 2004
+};
+
+// Envia as métricas ao Graphite por uma conexão TCP persistente. As métricas são
+// enfileiradas em um buffer limitado e uma thread dedicada as formata e escreve
+// em lote, de modo que quem chama post() nunca bloqueia na rede. O que não puder
+// ser entregue vai para o SpillLog (em plaintext), quando configurado.
+class GraphiteSender : public MetricSink {
+public:
+    ~GraphiteSender() {
+        stop();
+    }
+
+    // Com block_when_full (reprodução) post espera a fila esvaziar em vez de descartar as mais antigas
+    void start(const std::string& graphite_host, int graphite_port, GraphiteProtocol graphite_protocol,
+        SpillLog* spill_log, bool block_when_full) {
+        connection = std::make_unique<GraphiteConnection>(graphite_host, graphite_port);
+        protocol = graphite_protocol;
+        spill = spill_log;
+        blocking = block_when_full;
+        running = true;
+        sender_thread = std::thread(&GraphiteSender::run, this);
+    }
+
+    // Interrompe a thread de envio depois de uma última tentativa de esvaziar a fila
+    void stop() override {
+        {
+            std::lock_guard<std::mutex> lock(queue_mtx);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        queue_cv.notify_one();
+        space_cv.notify_all();
+        if (sender_thread.joinable()) {
+            sender_thread.join();
+        }
+        connection.reset();
+    }
+
+    void post(Metric metric) override {
+        bool flush_now;
+        {
+            std::unique_lock<std::mutex> lock(queue_mtx, std::try_to_lock);
+            if (!lock.owns_lock()) {
+                int64_t wait_start = monotonic_ns();
+                lock.lock();
+                processor_stats.lock_wait.record(monotonic_ns() - wait_start);
+            }
+            if (blocking && queue.size() + batch_size >= GRAPHITE_QUEUE_CAPACITY) {
+                queue_cv.notify_one();
+                space_cv.wait(lock, [this] { return queue.size() + batch_size < GRAPHITE_QUEUE_CAPACITY || !running; });
+            }
+            if (queue.empty()) {
+                oldest_enqueue_ns = monotonic_ns();
+            }
+            if (queue.size() >= GRAPHITE_QUEUE_CAPACITY) {
+                queued_bytes -= queue.front().path.size() + 32;
+                queue.pop_front();
+                ++dropped;
+            }
+            queued_bytes += metric.path.size() + 32; // valor e timestamp formatados
+            queue.push_back(std::move(metric));
+            flush_now = queued_bytes >= GRAPHITE_BATCH_BYTES;
+        }
+        if (flush_now) {
+            queue_cv.notify_one();
+        }
+    }
+
+    // Métricas aguardando envio (na fila e no lote em andamento)
+    size_t backlog() override {
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        return queue.size() + batch_size;
+    }
+
+private:
+    // Formata o lote em blocos de até GRAPHITE_FRAME_METRICS métricas, reaproveitando os buffers
+    void encode(const std::deque<Metric>& batch) {
+        size_t frame_count = (batch.size() + GRAPHITE_FRAME_METRICS - 1) / GRAPHITE_FRAME_METRICS;
+        frames.resize(frame_count);
+        for (size_t frame = 0; frame < frame_count; ++frame) {
+            size_t begin = frame * GRAPHITE_FRAME_METRICS;
+            size_t end = std::min(begin + GRAPHITE_FRAME_METRICS, batch.size());
+            std::string& out = frames[frame];
+            out.clear();
+            if (protocol == GraphiteProtocol::Pickle) {
+                append_pickle_frame(out, batch, begin, end);
+            } else {
+                for (size_t i = begin; i < end; ++i) {
+                    append_plaintext(out, batch[i]);
+                }
+            }
+        }
+    }
+
+    void run() {
+        std::deque<Metric> batch;
+        int64_t batch_oldest_ns = 0;
+        std::string line;
+
+        while (true) {
+            bool keep_running;
+            {
+                std::unique_lock<std::mutex> lock(queue_mtx);
+                queue_cv.wait_for(lock, std::chrono::milliseconds(GRAPHITE_FLUSH_INTERVAL_MS), [this] {
+                    return !running || queued_bytes >= GRAPHITE_BATCH_BYTES;
+                });
+                keep_running = running;
+
+                // Junta a fila ao que sobrou do lote anterior, respeitando a capacidade
+                if (batch.empty() && !queue.empty()) {
+                    batch_oldest_ns = oldest_enqueue_ns;
+                }
+                for (auto& line : queue) {
+                    batch.push_back(std::move(line));
+                }
+                queue.clear();
+                queued_bytes = 0;
+                while (batch.size() > GRAPHITE_QUEUE_CAPACITY) {
+                    batch.pop_front();
+                    ++dropped;
+                }
+                if (dropped > 0) {
+                    log_text(LogLevel::Warn, "Warning: Graphite queue full, ", dropped, " metric(s) discarded");
+                    dropped = 0;
+                }
+                batch_size = batch.size();
+            }
+
+            if (!batch.empty() && connection->ensure_connected()) {
+                // Um bloco enviado pela metade é reenviado inteiro; o Graphite sobrescreve pontos repetidos
+                encode(batch);
+                size_t sent_frames = 0;
+                if (!connection->write_lines(frames, sent_frames)) {
+                    log_text(LogLevel::Error, "Error: Failed to send metric batch to Graphite, reconnecting");
+                    connection->fail();
+                }
+                size_t sent_metrics = std::min(sent_frames * GRAPHITE_FRAME_METRICS, batch.size());
+                processor_stats.graphite_lines_sent.fetch_add(sent_metrics, std::memory_order_relaxed);
+                if (sent_metrics == batch.size()) {
+                    processor_stats.graphite_flush.record(monotonic_ns() - batch_oldest_ns);
+                }
+                batch.erase(batch.begin(), batch.begin() + sent_metrics);
+            }
+
+            // Sem conexão, o lote vai para o disco e será reenviado pelo SpillReplayer
+            if (!batch.empty() && spill != nullptr) {
+                for (const Metric& metric : batch) {
+                    line.clear();
+                    append_plaintext(line, metric);
+                    spill->append(line);
+                }
+                processor_stats.graphite_lines_spilled.fetch_add(batch.size(), std::memory_order_relaxed);
+                batch.clear();
+            }
+            if (batch.empty()) {
+                std::lock_guard<std::mutex> lock(queue_mtx);
+                batch_size = 0;
+            }
+            if (blocking) {
+                space_cv.notify_all();
+            }
+
+            if (!keep_running) {
+                return;
+            }
+        }
+    }
+
+    std::unique_ptr<GraphiteConnection> connection;
+    GraphiteProtocol protocol = GraphiteProtocol::Plaintext;
+    SpillLog* spill = nullptr;
+    std::vector<std::string> frames; // buffers de envio, usados só pela thread de envio
+
+    std::mutex queue_mtx;
+    std::condition_variable queue_cv;
+    std::condition_variable space_cv; // post bloqueado esperando espaço na fila
+    std::deque<Metric> queue;
+    size_t queued_bytes = 0;
+    size_t dropped = 0;
+    size_t batch_size = 0;         // métricas retidas pela thread de envio
+    int64_t oldest_enqueue_ns = 0; // quando a linha mais antiga da fila foi enfileirada
+    bool blocking = false;
+    bool running = false;
+    std::thread sender_thread;
+};
+
+// Envia as métricas ao StatsD como gauges ("<caminho>:<valor>|g"), várias por
+// datagrama UDP. O StatsD não recebe o timestamp: o ponto fica com o instante do
+// flush dele. Um datagrama é enviado ao encher e os incompletos a cada
+// GRAPHITE_FLUSH_INTERVAL_MS.
+class StatsdSink : public MetricSink {
+public:
+    ~StatsdSink() {
+        stop();
+    }
+
+    bool start(const std::string& host, int port) {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        struct addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+            std::cerr << "Error: Could not resolve StatsD host " << host << std::endl;
+            return false;
+        }
+        for (struct addrinfo* addr = addresses; addr != nullptr && statsd_socket == -1; addr = addr->ai_next) {
+            statsd_socket = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+            if (statsd_socket != -1 && connect(statsd_socket, addr->ai_addr, addr->ai_addrlen) == -1) {
+                close(statsd_socket);
+                statsd_socket = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (statsd_socket == -1) {
+            std::cerr << "Error: Could not open StatsD socket to " << host << ":" << port << std::endl;
+            return false;
+        }
+        datagram.reserve(STATSD_DATAGRAM_BYTES);
+        running = true;
+        flush_thread = std::thread(&StatsdSink::run, this);
+        return true;
+    }
+
+    void stop() override {
+        {
+            std::lock_guard<std::mutex> lock(datagram_mtx);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        flush_cv.notify_one();
+        if (flush_thread.joinable()) {
+            flush_thread.join();
+        }
+        close(statsd_socket);
+        statsd_socket = -1;
+    }
+
+    void post(Metric metric) override {
+        if (metric.path.size() > STATSD_PATH_MAX_BYTES) {
+            processor_stats.statsd_paths_rejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        // Um gauge com sinal é um incremento no StatsD: valores negativos são precedidos de um zero
+        char line[2 * (STATSD_PATH_MAX_BYTES + 40)];
+        char* end = line;
+        auto append_gauge = [&](double value) {
+            std::memcpy(end, metric.path.data(), metric.path.size());
+            end += metric.path.size();
+            *end++ = ':';
+            end = format_value(end, value);
+            std::memcpy(end, "|g\n", 3);
+            end += 3;
+        };
+        if (metric.value < 0) {
+            append_gauge(0.0);
+        }
+        append_gauge(metric.value);
+        size_t size = static_cast<size_t>(end - line);
+
+        std::lock_guard<std::mutex> lock(datagram_mtx);
+        if (datagram.size() + size > STATSD_DATAGRAM_BYTES) {
+            send_datagram();
+        }
+        datagram.append(line, size);
+        ++pending;
+    }
+
+    size_t backlog() override {
+        std::lock_guard<std::mutex> lock(datagram_mtx);
+        return pending;
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(datagram_mtx);
+        while (running) {
+            flush_cv.wait_for(lock, std::chrono::milliseconds(GRAPHITE_FLUSH_INTERVAL_MS));
+            send_datagram();
+        }
+    }
+
+    // Chamado com datagram_mtx travado. Perdas no UDP não são reenviadas.
+    void send_datagram() {
+        if (datagram.empty()) {
+            return;
+        }
+        datagram.pop_back(); // sem o '\n' final
+        if (send(statsd_socket, datagram.data(), datagram.size(), MSG_NOSIGNAL | MSG_DONTWAIT) >= 0) {
+            processor_stats.statsd_lines_sent.fetch_add(pending, std::memory_order_relaxed);
+        } else {
+            processor_stats.statsd_send_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        datagram.clear();
+        pending = 0;
+    }
+
+    int statsd_socket = -1;
+    std::mutex datagram_mtx;
+    std::condition_variable flush_cv;
+    std::string datagram;
+    size_t pending = 0;
+    bool running = false;
+    std::thread flush_thread;
+};
+
+SpillLog graphite_spill_log;
+SpillReplayer graphite_spill_replayer;
+GraphiteSender graphite_sender;        // plaintext
+GraphiteSender graphite_pickle_sender; // pickle
+StatsdSink statsd_sink;
+std::vector<MetricSink*> metric_sinks; // destinos ativos, escolhidos por config.sinks
+
+// Inicia os destinos listados em config.sinks. Numa reprodução (replay) as filas do
+// Graphite seguram o ritmo em vez de descartar métricas
+void start_metric_sinks(SpillLog* spill_log, bool replay) {
+    for (const std::string& sink : config.sinks) {
+        if (sink == "plaintext") {
+            graphite_sender.start(config.graphite_host, config.graphite_port, GraphiteProtocol::Plaintext, spill_log,
+                                  replay);
+            metric_sinks.push_back(&graphite_sender);
+        } else if (sink == "pickle") {
+            graphite_pickle_sender.start(config.graphite_host, config.graphite_pickle_port, GraphiteProtocol::Pickle,
+                                         spill_log, replay);
+            metric_sinks.push_back(&graphite_pickle_sender);
+        } else if (statsd_sink.start(config.statsd_host, config.statsd_port)) {
+            metric_sinks.push_back(&statsd_sink);
+        }
+    }
+}
+
+void stop_metric_sinks() {
+    for (MetricSink* sink : metric_sinks) {
+        sink->stop();
+    }
+}
+
+size_t metric_sinks_backlog() {
+    size_t backlog = 0;
+    for (MetricSink* sink : metric_sinks) {
+        backlog += sink->backlog();
+    }
+    return backlog;
+}
+
+// Envia uma métrica com o caminho completo a todos os destinos
+void post_graphite_metric(std::string path, std::time_t timestamp, const double value) {
+    for (size_t i = 0; i < metric_sinks.size(); ++i) {
+        bool last = i + 1 == metric_sinks.size();
+        metric_sinks[i]->post(Metric{last ? std::move(path) : path, timestamp, value});
+    }
+    processor_stats.metrics_posted.fetch_add(1, std::memory_order_relaxed);
+}
+
+int post_metric(const std::string& machine_id, const std::string& sensor_id, std::time_t timestamp, const double value) {
+    std::string graphite_topic;
+    graphite_topic.reserve(10 + machine_id.size() + sensor_id.size());
+    graphite_topic.append("machines.").append(machine_id).append(1, '.').append(sensor_id);
+    post_graphite_metric(std::move(graphite_topic), timestamp, value);
+    return 0; // Retorna sucesso
+}
+
+// REGISTRO DE SENSORES --------------------------------------------------------------------------------------
+
+#define REGISTRY_SHARDS 64         // Partições dos mapas de busca (menos disputa entre threads)
+#define REGISTRY_CHUNK_SIZE 4096   // Elementos por bloco do armazenamento estável
+#define REGISTRY_MAX_CHUNKS 4096   // Limite de blocos (até 16 milhões de nomes ou séries)
+
+// Vetor que cresce em blocos de tamanho fixo, sem nunca mover os elementos já
+// criados. Leitores acessam qualquer índice já publicado sem trava; novos blocos
+// são instalados com compare-and-swap.
+template <typename T>
+class StableArray {
+public:
+    StableArray() {
+        for (auto& chunk : chunks) {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~StableArray() {
+        for (auto& chunk : chunks) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    T& operator[](size_t index) const {
+        return chunks[index / REGISTRY_CHUNK_SIZE].load(std::memory_order_acquire)[index % REGISTRY_CHUNK_SIZE];
+    }
+
+    // Garante que o bloco que contém `index` existe e devolve o elemento
+    T& ensure(size_t index) {
+        size_t chunk_index = index / REGISTRY_CHUNK_SIZE;
+        if (chunk_index >= REGISTRY_MAX_CHUNKS) {
+            throw std::length_error("sensor registry is full");
+        }
+        T* chunk = chunks[chunk_index].load(std::memory_order_acquire);
+        if (chunk == nullptr) {
+            T* fresh = new T[REGISTRY_CHUNK_SIZE];
+            if (chunks[chunk_index].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) {
+                chunk = fresh;
+            } else {
+                delete[] fresh; // outra thread instalou o bloco primeiro
+            }
+        }
+        return chunk[index % REGISTRY_CHUNK_SIZE];
+    }
+
+private:
+    std::array<std::atomic<T*>, REGISTRY_MAX_CHUNKS> chunks;
+};
+
+// Internação de nomes: cada machine_id ou sensor_id distinto recebe um id inteiro
+// sequencial. As buscas, que são quase todas acertos, usam trava compartilhada.
+class NameTable {
+public:
+    uint32_t intern(std::string_view name) {
+        Shard& shard = shards[std::hash<std::string_view>()(name) % REGISTRY_SHARDS];
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mtx);
+            auto it = shard.ids.find(name);
+            if (it != shard.ids.end()) {
+                return it->second;
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(shard.mtx);
+        auto it = shard.ids.find(name);
+        if (it != shard.ids.end()) {
+            return it->second;
+        }
+        uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+        std::string& stored = names.ensure(id);
+        stored.assign(name);
+        shard.ids.emplace(stored, id); // a chave aponta para o nome armazenado, que nunca se move
+        return id;
+    }
+
+    // Procura um nome sem registrá-lo
+    bool find(std::string_view name, uint32_t& id) {
+        Shard& shard = shards[std::hash<std::string_view>()(name) % REGISTRY_SHARDS];
+        std::shared_lock<std::shared_mutex> lock(shard.mtx);
+        auto it = shard.ids.find(name);
+        if (it == shard.ids.end()) {
+            return false;
+        }
+        id = it->second;
+        return true;
+    }
+
+    const std::string& name(uint32_t id) const {
+        return names[id];
+    }
+
+    size_t size() const {
+        return next_id.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Shard {
+        std::shared_mutex mtx;
+        std::unordered_map<std::string_view, uint32_t> ids;
+    };
+
+    std::array<Shard, REGISTRY_SHARDS> shards;
+    StableArray<std::string> names;
+    std::atomic<uint32_t> next_id{0};
+};
+
+// Uma série monitorada (máquina, sensor). last_timestamp é atualizado pelo worker
+// dono da máquina e lido pelo agendador de inatividade, ambos sem trava; o prazo
+// de inatividade pode mudar quando a máquina volta a anunciar os seus sensores.
+struct SeriesInfo {
+    uint32_t machine = 0;
+    uint32_t sensor = 0;
+    const RulePlan* rules = nullptr;
+    std::atomic<int64_t> inactivity_timeout_s{0}; // 0: sem alarme de inatividade
+    std::atomic<std::time_t> last_timestamp{0};
+    std::atomic<bool> absent{false};            // alarme de inatividade disparado e ainda não limpo
+};
+
+class SensorRegistry {
+public:
+    NameTable machines;
+    NameTable sensors;
+
+    // Devolve o id da série; created indica se ela acabou de ser registrada
+    uint32_t find_or_add(std::string_view machine_id, std::string_view sensor_id, std::time_t timestamp, bool& created) {
+        uint32_t machine = machines.intern(machine_id);
+        uint32_t sensor = sensors.intern(sensor_id);
+        uint64_t key = (static_cast<uint64_t>(machine) << 32) | sensor;
+        Shard& shard = shards[std::hash<uint64_t>()(key) % REGISTRY_SHARDS];
+        created = false;
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mtx);
+            auto it = shard.ids.find(key);
+            if (it != shard.ids.end()) {
+                return it->second;
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(shard.mtx);
+        auto it = shard.ids.find(key);
+        if (it != shard.ids.end()) {
+            return it->second;
+        }
+        uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+        SeriesInfo& info = series_infos.ensure(id);
+        info.machine = machine;
+        info.sensor = sensor;
+        info.rules = &rule_book.plan(sensors.name(sensor));
+        info.inactivity_timeout_s.store(info.rules->absence.count(), std::memory_order_relaxed);
+        info.last_timestamp.store(timestamp, std::memory_order_relaxed);
+        shard.ids.emplace(key, id);
+        created = true;
+        return id;
+    }
+
+    // Procura uma série já registrada, sem criá-la
+    bool find(std::string_view machine_id, std::string_view sensor_id, uint32_t& series_id) {
+        uint32_t machine, sensor;
+        if (!machines.find(machine_id, machine) || !sensors.find(sensor_id, sensor)) {
+            return false;
+        }
+        uint64_t key = (static_cast<uint64_t>(machine) << 32) | sensor;
+        Shard& shard = shards[std::hash<uint64_t>()(key) % REGISTRY_SHARDS];
+        std::shared_lock<std::shared_mutex> lock(shard.mtx);
+        auto it = shard.ids.find(key);
+        if (it == shard.ids.end()) {
+            return false;
+        }
+        series_id = it->second;
+        return true;
+    }
+
+    SeriesInfo& series(uint32_t id) const {
+        return series_infos[id];
+    }
+
+    const std::string& machine_name(uint32_t id) const {
+        return machines.name(series(id).machine);
+    }
+
+    const std::string& sensor_name(uint32_t id) const {
+        return sensors.name(series(id).sensor);
+    }
+
+    size_t size() const {
+        return next_id.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Shard {
+        std::shared_mutex mtx;
+        std::unordered_map<uint64_t, uint32_t> ids;
+    };
+
+    std::array<Shard, REGISTRY_SHARDS> shards;
+    StableArray<SeriesInfo> series_infos;
+    std::atomic<uint32_t> next_id{0};
+};
+
+SensorRegistry sensor_registry;
+
+// HISTÓRICO RECENTE --------------------------------------------------------------------------------------------
+
+// Sequência de bits gravada do bit mais significativo para o menos significativo
+class BitWriter {
+public:
+    void write(uint64_t value, unsigned count) {
+        if (count < 64) {
+            value &= (uint64_t(1) << count) - 1;
+        }
+        unsigned offset = bits % 64;
+        if (offset == 0) {
+            words.push_back(0);
+        }
+        unsigned free_bits = 64 - offset;
+        if (count <= free_bits) {
+            words.back() |= value << (free_bits - count);
+        } else {
+            unsigned rest = count - free_bits;
+            words.back() |= value >> rest;
+            words.push_back(value << (64 - rest));
+        }
+        bits += count;
+    }
+
+    size_t bytes() const {
+        return words.capacity() * sizeof(uint64_t);
+    }
+
+    void shrink() {
+        words.shrink_to_fit();
+    }
+
+    std::vector<uint64_t> words;
+    size_t bits = 0;
+};
+
+class BitReader {
+public:
+    explicit BitReader(const std::vector<uint64_t>& stream_words) : words(stream_words) {}
+
+    uint64_t read(unsigned count) {
+        unsigned offset = position % 64;
+        unsigned available = 64 - offset;
+        uint64_t word = words[position / 64];
+        uint64_t value;
+        if (count <= available) {
+            value = (word << offset) >> (64 - count);
+        } else {
+            unsigned rest = count - available;
+            value = (((word << offset) >> offset) << rest) | (words[position / 64 + 1] >> (64 - rest));
+        }
+        position += count;
+        return value;
+    }
+
+    bool bit() {
+        return read(1) != 0;
+    }
+
+private:
+    const std::vector<uint64_t>& words;
+    size_t position = 0;
+};
+
+// Interpreta os `count` bits mais baixos de value como um inteiro com sinal
+int64_t sign_extend(uint64_t value, unsigned count) {
+    uint64_t sign = uint64_t(1) << (count - 1);
+    return static_cast<int64_t>((value ^ sign) - sign);
+}
+
+// Bloco comprimido no formato do Gorilla (Facebook): timestamps como delta do
+// delta e valores como XOR com o anterior. Leituras periódicas de um sensor
+// costumam ocupar de 1 a 2 bytes por ponto.
+class HistoryBlock {
+public:
+    void append(std::time_t timestamp, double value) {
+        uint64_t value_bits;
+        std::memcpy(&value_bits, &value, sizeof(value_bits));
+        if (count == 0) {
+            first = min_timestamp = max_timestamp = timestamp;
+            stream.write(static_cast<uint64_t>(timestamp), 64);
+            stream.write(value_bits, 64);
+        } else {
+            append_timestamp(timestamp);
+            append_value(value_bits);
+        }
+        last_timestamp = timestamp;
+        last_bits = value_bits;
+        min_timestamp = std::min(min_timestamp, timestamp);
+        max_timestamp = std::max(max_timestamp, timestamp);
+        ++count;
+    }
+
+    // Chama visit(timestamp, valor) para cada ponto, em ordem de chegada
+    template <typename Visit>
+    void for_each(Visit&& visit) const {
+        if (count == 0) {
+            return;
+        }
+        BitReader reader(stream.words);
+        std::time_t timestamp = static_cast<std::time_t>(reader.read(64));
+        uint64_t value_bits = reader.read(64);
+        int64_t delta = 0;
+        unsigned leading = 0, meaningful = 0;
+        visit(timestamp, to_double(value_bits));
+        for (uint32_t i = 1; i < count; ++i) {
+            if (reader.bit()) {
+                int64_t delta_of_delta;
+                if (!reader.bit()) {
+                    delta_of_delta = sign_extend(reader.read(7), 7);
+                } else if (!reader.bit()) {
+                    delta_of_delta = sign_extend(reader.read(9), 9);
+                } else if (!reader.bit()) {
+                    delta_of_delta = sign_extend(reader.read(12), 12);
+                } else {
+                    delta_of_delta = static_cast<int64_t>(reader.read(64));
+                }
+                delta += delta_of_delta;
+            }
+            timestamp += delta;
+
+            if (reader.bit()) {
+                if (reader.bit()) {
+                    leading = static_cast<unsigned>(reader.read(5));
+                    meaningful = static_cast<unsigned>(reader.read(6)) + 1;
+                }
+                value_bits ^= reader.read(meaningful) << (64 - leading - meaningful);
+            }
+            visit(timestamp, to_double(value_bits));
+        }
+    }
+
+    size_t bytes() const {
+        return stream.bytes();
+    }
+
+    void shrink() {
+        stream.shrink();
+    }
+
+    std::time_t first = 0; // timestamp do primeiro ponto, que define o início do bloco
+    std::time_t min_timestamp = 0;
+    std::time_t max_timestamp = 0;
+    uint32_t count = 0;
+
+private:
+    static double to_double(uint64_t bits) {
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    void append_timestamp(std::time_t timestamp) {
+        int64_t delta = timestamp - last_timestamp;
+        int64_t delta_of_delta = delta - last_delta;
+        last_delta = delta;
+        if (delta_of_delta == 0) {
+            stream.write(0, 1);
+        } else if (delta_of_delta >= -64 && delta_of_delta <= 63) {
+            stream.write(0b10, 2);
+            stream.write(static_cast<uint64_t>(delta_of_delta), 7);
+        } else if (delta_of_delta >= -256 && delta_of_delta <= 255) {
+            stream.write(0b110, 3);
+            stream.write(static_cast<uint64_t>(delta_of_delta), 9);
+        } else if (delta_of_delta >= -2048 && delta_of_delta <= 2047) {
+            stream.write(0b1110, 4);
+            stream.write(static_cast<uint64_t>(delta_of_delta), 12);
+        } else {
+            stream.write(0b1111, 4);
+            stream.write(static_cast<uint64_t>(delta_of_delta), 64);
+        }
+    }
+
+    void append_value(uint64_t value_bits) {
+        uint64_t xored = value_bits ^ last_bits;
+        if (xored == 0) {
+            stream.write(0, 1);
+            return;
+        }
+        unsigned leading = std::min(__builtin_clzll(xored), 31);
+        unsigned trailing = __builtin_ctzll(xored);
+        if (window_meaningful > 0 && leading >= window_leading &&
+            trailing >= 64 - window_leading - window_meaningful) {
+            // Os bits diferentes cabem na janela do valor anterior
+            stream.write(0b10, 2);
+            stream.write(xored >> (64 - window_leading - window_meaningful), window_meaningful);
+            return;
+        }
+        window_leading = leading;
+        window_meaningful = 64 - leading - trailing;
+        stream.write(0b11, 2);
+        stream.write(window_leading, 5);
+        stream.write(window_meaningful - 1, 6);
+        stream.write(xored >> trailing, window_meaningful);
+    }
+
+    BitWriter stream;
+    std::time_t last_timestamp = 0;
+    int64_t last_delta = 0;
+    uint64_t last_bits = 0;
+    unsigned window_leading = 0;
+    unsigned window_meaningful = 0; // 0 = ainda sem janela
+};
+
+// Histórico recente de uma série: blocos de history_block segundos, o último
+// ainda aberto. O worker dono da máquina grava e o socket de consultas lê; a
+// trava só é disputada durante uma consulta.
+struct SeriesHistory {
+    std::mutex mtx;
+    std::deque<HistoryBlock> blocks;
+    std::time_t last_timestamp = 0;
+    double last_value = 0.0;
+};
+
+class HistoryStore {
+public:
+    // Reserva a entrada de uma série anunciada, para que a primeira amostra não a aloque
+    void provision(uint32_t series_id) {
+        series.ensure(series_id);
+    }
+
+    void append(uint32_t series_id, std::time_t timestamp, double value) {
+        SeriesHistory& history = series.ensure(series_id);
+        std::lock_guard<std::mutex> lock(history.mtx);
+        int64_t before = history.blocks.empty() ? 0 : static_cast<int64_t>(history.blocks.back().bytes());
+        int64_t released = 0;
+        if (history.blocks.empty() || timestamp >= history.blocks.back().first + config.history_block.count()) {
+            if (!history.blocks.empty()) {
+                history.blocks.back().shrink(); // o bloco fechado não cresce mais
+                released = before - static_cast<int64_t>(history.blocks.back().bytes());
+            }
+            history.blocks.emplace_back();
+            before = 0;
+        }
+        history.blocks.back().append(timestamp, value);
+        int64_t grown = static_cast<int64_t>(history.blocks.back().bytes()) - before - released;
+
+        // Descarta os blocos que saíram da retenção
+        while (history.blocks.size() > 1 &&
+               history.blocks.front().max_timestamp < timestamp - config.history_retention.count()) {
+            grown -= static_cast<int64_t>(history.blocks.front().bytes());
+            points -= history.blocks.front().count;
+            history.blocks.pop_front();
+        }
+        if (timestamp >= history.last_timestamp) {
+            history.last_timestamp = timestamp;
+            history.last_value = value;
+        }
+        stored_bytes += grown;
+        ++points;
+    }
+
+    // Último valor recebido da série
+    bool last(uint32_t series_id, std::time_t& timestamp, double& value) {
+        SeriesHistory& history = series.ensure(series_id);
+        std::lock_guard<std::mutex> lock(history.mtx);
+        if (history.blocks.empty()) {
+            return false;
+        }
+        timestamp = history.last_timestamp;
+        value = history.last_value;
+        return true;
+    }
+
+    // Chama visit(timestamp, valor) para os pontos com timestamp em [from, to]
+    template <typename Visit>
+    void range(uint32_t series_id, std::time_t from, std::time_t to, Visit&& visit) {
+        SeriesHistory& history = series.ensure(series_id);
+        std::lock_guard<std::mutex> lock(history.mtx);
+        for (const HistoryBlock& block : history.blocks) {
+            if (block.max_timestamp < from || block.min_timestamp > to) {
+                continue;
+            }
+            block.for_each([&](std::time_t timestamp, double value) {
+                if (timestamp >= from && timestamp <= to) {
+                    visit(timestamp, value);
+                }
+            });
+        }
+    }
+
+    size_t bytes() const {
+        return static_cast<size_t>(stored_bytes.load(std::memory_order_relaxed));
+    }
+
+    size_t size() const {
+        return static_cast<size_t>(points.load(std::memory_order_relaxed));
+    }
+
+private:
+    StableArray<SeriesHistory> series;
+    std::atomic<int64_t> stored_bytes{0};
+    std::atomic<int64_t> points{0};
+};
+
+HistoryStore history_store;
+
+// Comando "history" do socket de consultas:
+//   history last <máquina> <sensor>
+//   history range <máquina> <sensor> [de] [até]
+//   history aggregate <máquina> <sensor> [de] [até]
+// de/até são timestamps Unix; valores negativos contam a partir de agora (-600 = últimos 10 minutos)
+std::string handle_history(const std::string& arguments) {
+    std::istringstream parser(arguments);
+    std::string query, machine_id, sensor_id;
+    parser >> query >> machine_id >> sensor_id;
+    if (query.empty() || sensor_id.empty()) {
+        return "error: usage: history last|range|aggregate <machine> <sensor> [from] [to]\n";
+    }
+    uint32_t series_id;
+    if (config.history_retention.count() == 0 || !sensor_registry.find(machine_id, sensor_id, series_id)) {
+        return "error: no history for " + machine_id + " " + sensor_id + "\n";
+    }
+
+    std::time_t now = std::time(nullptr);
+    std::time_t from = std::numeric_limits<std::time_t>::min();
+    std::time_t to = std::numeric_limits<std::time_t>::max();
+    if (parser >> from) {
+        from = from < 0 ? now + from : from;
+        if (parser >> to) {
+            to = to < 0 ? now + to : to;
+        }
+    }
+
+    std::ostringstream response;
+    if (query == "last") {
+        std::time_t timestamp;
+        double value;
+        if (!history_store.last(series_id, timestamp, value)) {
+            return "error: no history for " + machine_id + " " + sensor_id + "\n";
+        }
+        response << timestamp << " " << value << "\n";
+    } else if (query == "range") {
+        history_store.range(series_id, from, to, [&](std::time_t timestamp, double value) {
+            response << timestamp << " " << value << "\n";
+        });
+    } else if (query == "aggregate") {
+        uint64_t count = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        double sum = 0.0;
+        history_store.range(series_id, from, to, [&](std::time_t, double value) {
+            ++count;
+            min = std::min(min, value);
+            max = std::max(max, value);
+            sum += value;
+        });
+        response << "count " << count << "\n";
+        if (count > 0) {
+            response << "min " << min << "\nmax " << max << "\navg " << sum / count << "\nsum " << sum << "\n";
+        }
+    } else {
+        return "error: unknown history query \"" + query + "\"\n";
+    }
+    return response.str();
+}
+
+// PARTIÇÃO DA FROTA --------------------------------------------------------------------------------------------
+
+#define PRESENCE_TOPIC_PREFIX "/data_processors/" // Anúncio (retido) de cada instância ativa
+#define HASH_RING_POINTS 128                      // Pontos de cada instância no anel
+
+// FNV-1a seguido de uma mistura final: estável entre processos e versões do
+// compilador, já que todas as instâncias precisam chegar à mesma divisão
+uint64_t stable_hash(std::string_view text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Anel de hash consistente: cada instância ocupa HASH_RING_POINTS pontos e uma
+// máquina pertence à dona do primeiro ponto depois do hash do seu id. Quando uma
+// instância entra ou sai, só as máquinas vizinhas aos seus pontos mudam de dona.
+class HashRing {
+public:
+    explicit HashRing(std::vector<std::string> instances) : members(std::move(instances)) {
+        for (uint32_t member = 0; member < members.size(); ++member) {
+            for (int point = 0; point < HASH_RING_POINTS; ++point) {
+                points.emplace_back(stable_hash(members[member] + "#" + std::to_string(point)), member);
+            }
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    const std::string& owner(std::string_view machine_id) const {
+        auto it = std::upper_bound(points.begin(), points.end(),
+                                   std::make_pair(stable_hash(machine_id), std::numeric_limits<uint32_t>::max()));
+        return members[(it == points.end() ? points.front() : *it).second];
+    }
+
+    const std::vector<std::string> members;
+
+private:
+    std::vector<std::pair<uint64_t, uint32_t>> points;
+};
+
+// Máquinas atendidas por esta instância no modo Partitioning::Hash. Os membros
+// vêm dos anúncios em PRESENCE_TOPIC_PREFIX (entregues pela thread do MQTT); o
+// anel é trocado inteiro a cada mudança e lido sem trava pelas demais threads.
+class FleetPartition {
+public:
+    void start(const std::string& instance_id) {
+        self = instance_id;
+        enabled = true;
+        update_member(instance_id, true);
+    }
+
+    bool owns(std::string_view machine_id) const {
+        if (!enabled) {
+            return true;
+        }
+        std::shared_ptr<const HashRing> current = std::atomic_load(&ring);
+        return current->owner(machine_id) == self;
+    }
+
+    // Se a máquina já era desta instância antes da última mudança de membros
+    bool owned_before_change(std::string_view machine_id) const {
+        std::shared_ptr<const HashRing> before = std::atomic_load(&previous_ring);
+        return before == nullptr || before->owner(machine_id) == self;
+    }
+
+    // Incrementado a cada mudança de membros; os workers o comparam para reconstruir estados
+    uint64_t epoch() const {
+        return ring_epoch.load(std::memory_order_acquire);
+    }
+
+    void update_member(const std::string& instance_id, bool present) {
+        std::lock_guard<std::mutex> lock(members_mtx);
+        if (instance_id == self && !present) {
+            return; // a própria instância continua ativa mesmo que o anúncio retido tenha sido apagado
+        }
+        if (present ? !members.insert(instance_id).second : members.erase(instance_id) == 0) {
+            return;
+        }
+        std::atomic_store(&previous_ring, std::atomic_load(&ring));
+        std::atomic_store(&ring, std::make_shared<const HashRing>(
+            std::vector<std::string>(members.begin(), members.end())));
+        ring_epoch.fetch_add(1, std::memory_order_acq_rel);
+        log_text(LogLevel::Info, "Partition: ", members.size(), " instance(s) after ",
+                 present ? "joining of " : "leaving of ", instance_id);
+    }
+
+    // Resposta do comando "partition" do socket de estatísticas
+    std::string describe() {
+        std::lock_guard<std::mutex> lock(members_mtx);
+        if (!enabled) {
+            return "partitioning disabled\n";
+        }
+        std::ostringstream text;
+        text << "self " << self << "\n";
+        for (const std::string& member : members) {
+            text << "member " << member << "\n";
+        }
+        return text.str();
+    }
+
+private:
+    std::string self;
+    bool enabled = false;
+    std::mutex members_mtx;
+    std::set<std::string> members;
+    std::shared_ptr<const HashRing> ring;
+    std::shared_ptr<const HashRing> previous_ring;
+    std::atomic<uint64_t> ring_epoch{0};
+};
+
+FleetPartition fleet_partition;
+
+// No modo compartilhado o broker espalha as amostras de uma máquina entre as
+// instâncias, e nenhuma delas vê a série inteira. As análises por série
+// (janela, regras, agregados, quantis e inatividade) iriam para os mesmos
+// caminhos machines.<máquina>.* com valores calculados sobre partes diferentes,
+// então só são feitas quando cada máquina tem uma única instância.
+bool per_series_analytics() {
+    return config.partitioning != Partitioning::Shared;
+}
+
+// Nome desta instância nos caminhos das métricas próprias e da frota, para que
+// várias instâncias não sobrescrevam as séries umas das outras. Vazio quando a
+// frota não é dividida.
+std::string instance_metric_id;
+
+std::string metric_path_safe(std::string name) {
+    std::replace_if(name.begin(), name.end(), [](char c) {
+        return c == '.' || c == ' ' || c == '/';
+    }, '_');
+    return name;
+}
+
+// PROCESSAMENTO DE DADOS ---------------------------------------------------------------------------------------
+
+#define ROLLUP_GRACE_S 5 // Atraso tolerado para amostras de um intervalo que já terminou
+#define SKETCH_BAND_REFRESH 16 // Amostras entre recálculos da faixa normal do método "quantile"
+
+// Agregado de uma série no intervalo [start, start + interval), alinhado a
+// múltiplos de interval
+struct RollupBucket {
+    std::time_t interval;
+    std::time_t start = 0;
+    uint64_t count = 0;
+    double min = 0.0;
+    double max = 0.0;
+    double sum = 0.0;
+    double last = 0.0;
+
+    explicit RollupBucket(std::time_t interval) : interval(interval) {}
+
+    void add(double value) {
+        if (count == 0) {
+            min = max = value;
+            sum = 0.0;
+        } else {
+            min = std::min(min, value);
+            max = std::max(max, value);
+        }
+        sum += value;
+        last = value;
+        ++count;
+    }
+};
+
+// Estado de uma regra numa série
+struct RuleState {
+    std::time_t breach_since = std::numeric_limits<std::time_t>::max(); // início da violação em curso
+    bool active = false;
+};
+
+// Estado de análise de uma série (máquina, sensor)
+struct SeriesState {
+    RollingWindow window;
+    const SensorConfig* sensor_config;
+    const RulePlan* rules;
+    std::vector<RuleState> rule_states;  // um por regra do plano
+    std::vector<double> signals;         // sinais da amostra atual, indexados por CompiledRule::signal
+    double previous_value = 0.0;         // para as regras de taxa de variação
+    std::time_t previous_timestamp = 0;
+    std::vector<RollupBucket> rollups;
+    std::time_t last_sample_timestamp = 0; // Relógio do sensor na última amostra...
+    std::time_t last_sample_arrival = 0;   // ...e o relógio local quando ela chegou
+    std::unique_ptr<QuantileSketch> sketch; // Só para sensores que usam quantis
+    std::time_t quantiles_period = 0;       // Início do período cujos quantis ainda não foram enviados
+    std::vector<std::pair<double, double>> bands; // Faixas das regras "percentile", recalculadas a
+                                                  // cada SKETCH_BAND_REFRESH amostras
+    uint64_t partition_epoch = fleet_partition.epoch(); // Divisão da frota vista pela última amostra
+
+    SeriesState(const SensorConfig& sensor, const RulePlan& plan)
+        : window(sensor.window), sensor_config(&sensor), rules(&plan), rule_states(plan.rules.size()),
+          signals(plan.signal_count(), std::numeric_limits<double>::quiet_NaN()), bands(plan.band_quantiles.size()) {
+        for (std::chrono::seconds interval : sensor.rollups) {
+            rollups.emplace_back(interval.count());
+        }
+        if (sensor.uses_sketch() || !plan.band_quantiles.empty()) {
+            sketch = std::make_unique<QuantileSketch>(sensor.sketch_half_life);
+        }
+    }
+};
+
+// Nome do quantil no caminho da métrica: 0.5 -> p50, 0.99 -> p99, 0.999 -> p999
+std::string quantile_label(double q) {
+    char digits[16];
+    std::snprintf(digits, sizeof(digits), "%.6f", q);
+    std::string label = digits + 2; // sem o "0."
+    while (label.size() > 2 && label.back() == '0') {
+        label.pop_back();
+    }
+    return "p" + label;
+}
+
+// Ao começar um novo período, envia os quantis do sketch como estavam no fim do
+// anterior (<sensor>.<sensor>_p50...), com o timestamp do início dele
+void post_quantiles(const std::string& machine_id, const std::string& sensor_id, std::time_t timestamp,
+    SeriesState& state) {
+    std::time_t interval = state.sensor_config->quantiles_interval.count();
+    std::time_t period = timestamp - ((timestamp % interval) + interval) % interval;
+    if (period <= state.quantiles_period) {
+        return;
+    }
+    if (state.quantiles_period != 0 && state.sketch->count() > 0) {
+        for (double q : state.sensor_config->quantiles) {
+            post_metric(machine_id, sensor_id + "." + sensor_id + "_" + quantile_label(q), state.quantiles_period,
+                        state.sketch->quantile(q));
+        }
+    }
+    state.quantiles_period = period;
+}
+
+// Nome do intervalo no caminho da métrica: 10s, 1m, 10m, 1h...
+std::string rollup_label(std::time_t interval) {
+    if (interval % 3600 == 0) {
+        return std::to_string(interval / 3600) + "h";
+    }
+    if (interval % 60 == 0) {
+        return std::to_string(interval / 60) + "m";
+    }
+    return std::to_string(interval) + "s";
+}
+
+// Envia um intervalo fechado como <sensor>.<sensor>.rollup_<intervalo>.{min,max,avg,sum,count,last},
+// com o timestamp do início do intervalo
+void post_rollup(const std::string& machine_id, const std::string& sensor_id, RollupBucket& bucket) {
+    std::string prefix = sensor_id + "." + sensor_id + ".rollup_" + rollup_label(bucket.interval) + ".";
+    post_metric(machine_id, prefix + "min", bucket.start, bucket.min);
+    post_metric(machine_id, prefix + "max", bucket.start, bucket.max);
+    post_metric(machine_id, prefix + "avg", bucket.start, bucket.sum / bucket.count);
+    post_metric(machine_id, prefix + "sum", bucket.start, bucket.sum);
+    post_metric(machine_id, prefix + "count", bucket.start, static_cast<double>(bucket.count));
+    post_metric(machine_id, prefix + "last", bucket.start, bucket.last);
+    bucket.count = 0;
+}
+
+// Soma a amostra aos intervalos abertos, enviando os que ela fecha. Amostras
+// anteriores ao intervalo aberto (fora de ordem) não entram nos agregados.
+void update_rollups(const std::string& machine_id, const std::string& sensor_id, std::time_t timestamp, double value,
+    SeriesState& state) {
+    if (state.rollups.empty()) {
+        return;
+    }
+    state.last_sample_timestamp = std::max(state.last_sample_timestamp, timestamp);
+    state.last_sample_arrival = std::time(nullptr);
+    for (RollupBucket& bucket : state.rollups) {
+        std::time_t start = timestamp - ((timestamp % bucket.interval) + bucket.interval) % bucket.interval;
+        if (bucket.count > 0 && start != bucket.start) {
+            if (start < bucket.start) {
+                continue;
+            }
+            post_rollup(machine_id, sensor_id, bucket);
+        }
+        if (bucket.count == 0) {
+            bucket.start = start;
+        }
+        bucket.add(value);
+    }
+}
+
+// Envia os intervalos que terminaram antes de `now` (menos a tolerância), para
+// séries que pararam de receber amostras. `now` está no relógio do sensor.
+void flush_rollups(const std::string& machine_id, const std::string& sensor_id, SeriesState& state, std::time_t now) {
+    for (RollupBucket& bucket : state.rollups) {
+        if (bucket.count > 0 && bucket.start + bucket.interval + ROLLUP_GRACE_S <= now) {
+            post_rollup(machine_id, sensor_id, bucket);
+        }
+    }
+}
+
+// Calcula os sinais usados pelas regras do plano da série. Sinais indisponíveis
+// (taxa na primeira amostra, faixa antes de quantile_min_samples) ficam NaN e
+// não disparam nem limpam alarmes.
+void compute_signals(std::time_t timestamp, double value, SeriesState& state) {
+    const RulePlan& plan = *state.rules;
+    std::vector<double>& signals = state.signals;
+    signals[SIGNAL_VALUE] = value;
+    if (plan.uses_rate) {
+        std::time_t elapsed = timestamp - state.previous_timestamp;
+        signals[SIGNAL_RATE] = state.previous_timestamp != 0 && elapsed > 0
+            ? (value - state.previous_value) / elapsed : std::numeric_limits<double>::quiet_NaN();
+        state.previous_value = value;
+        state.previous_timestamp = timestamp;
+    }
+    if (plan.uses_zscore) {
+        signals[SIGNAL_ZSCORE] = std::abs(calculateZScore(value, state.window));
+    }
+    if (!plan.band_quantiles.empty()) {
+        QuantileSketch& sketch = *state.sketch;
+        bool ready = sketch.count() >= state.sensor_config->quantile_min_samples;
+        bool refresh = sketch.count() % SKETCH_BAND_REFRESH == 0;
+        for (size_t i = 0; i < plan.band_quantiles.size(); ++i) {
+            auto& [low, high] = state.bands[i];
+            if (refresh) {
+                high = sketch.quantile(plan.band_quantiles[i]);
+                low = sketch.quantile(1.0 - plan.band_quantiles[i]);
+            }
+            signals[SIGNAL_BANDS + i] = ready ? std::max(value - high, low - value)
+                                              : std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+}
+
+// Percorre a tabela de regras da série. O caminho comum (nenhuma mudança de
+// estado) não tem desvios dependentes do tipo de regra; só as transições enviam
+// alarms.<regra> ao Graphite, 1 ao disparar e 0 ao normalizar, uma vez cada.
+// Devolve se alguma regra está ativa.
+bool evaluate_rules(const std::string& machine_id, const std::string& sensor_id, std::time_t timestamp,
+    double value, SeriesState& state) {
+    const std::vector<CompiledRule>& rules = state.rules->rules;
+    bool any_active = false;
+    for (size_t i = 0; i < rules.size(); ++i) {
+        const CompiledRule& rule = rules[i];
+        RuleState& rule_state = state.rule_states[i];
+        double signal = rule.direction * state.signals[rule.signal];
+        bool breach = signal > rule.fire;
+        rule_state.breach_since = breach ? std::min(rule_state.breach_since, timestamp)
+                                         : std::numeric_limits<std::time_t>::max();
+        bool fire = !rule_state.active & breach & (timestamp - rule_state.breach_since >= rule.hold);
+        bool clear = rule_state.active & (signal <= rule.clear);
+        if (fire | clear) {
+            rule_state.active = fire;
+            post_metric(machine_id, rule.metric, timestamp, fire ? 1 : 0);
+            if (log_enabled(LogLevel::Warn)) {
+                logger.push(LogLevel::Warn, fire ? LogEvent::AlarmFired : LogEvent::AlarmCleared, [&](LogRecord& record) {
+                    record.machine = &machine_id;
+                    record.sensor = &sensor_id;
+                    record.rule = &rule.name;
+                    record.value = value;
+                });
+            }
+        }
+        any_active |= rule_state.active;
+    }
+    return any_active;
+}
+
+// machine_id e sensor_id devem ser os nomes guardados no registro de sensores: o
+// log guarda referências a eles e formata o relatório depois.
+void process_sensor_data(const std::string& machine_id, const std::string& sensor_id, std::time_t timestamp, 
+const double value, SeriesState& state) {
+    const SensorConfig& sensor_config = *state.sensor_config;
+    RollingWindow& sensorData = state.window;
+    bool post_raw_metrics = sensor_config.emit_raw;
+
+
+    // Coleta de dados do sensor
+    sensorData.push(value);
+
+    // Calcular a média móvel do sensor
+    double movingAverage = calculateMovingAverage(sensorData);
+    if (post_raw_metrics) {
+        post_metric(machine_id, sensor_id + "." + sensor_id + "_moving_average", timestamp, movingAverage);
+    }
+
+    // Avaliar as regras de alarme; as faixas de quantis não incluem a própria amostra
+    compute_signals(timestamp, value, state);
+    bool outlier = evaluate_rules(machine_id, sensor_id, timestamp, value, state);
+    if (state.sketch) {
+        if (!sensor_config.quantiles.empty()) {
+            post_quantiles(machine_id, sensor_id, timestamp, state);
+        }
+        state.sketch->add(value, timestamp);
+    }
+
+    // Calcular a tendência dos valores
+    double trend = calculateTrend(sensorData);
+    if (post_raw_metrics) {
+        post_metric(machine_id, sensor_id + "." + sensor_id + "_trend", timestamp, trend);
+    }
+
+    // O relatório completo é de nível info; os alarmes são registrados em warn por evaluate_rules
+    if (!log_enabled(LogLevel::Info)) {
+        return;
+    }
+    logger.push(LogLevel::Info, LogEvent::SensorReport, [&](LogRecord& record) {
+        record.machine = &machine_id;
+        record.sensor = &sensor_id;
+        record.timestamp = timestamp;
+        record.value = value;
+        record.moving_average = movingAverage;
+        record.trend = trend;
+        record.outlier = outlier;
+    });
+}
+
+// Verifica a série cujo prazo de inatividade venceu e devolve o próximo prazo.
+// Se chegaram dados desde o último agendamento, o prazo é apenas adiado; caso
+// contrário o alarme é gerado, uma única vez até a série voltar a enviar dados.
+std::time_t process_sensor_alarm(uint32_t series_id) {
+    SeriesInfo& sensor = sensor_registry.series(series_id);
+    std::time_t last_time = sensor.last_timestamp.load(std::memory_order_relaxed);
+    std::time_t max_expected_delay = sensor.inactivity_timeout_s.load(std::memory_order_relaxed); // máximo de atraso esperado para gerar um alarme
+
+    std::time_t current_time = std::time(nullptr);
+    if (current_time - last_time <= max_expected_delay) {
+        return last_time + max_expected_delay + 1;
+    }
+
+    const std::string& machine_id = sensor_registry.machine_name(series_id);
+    const std::string& sensor_name = sensor_registry.sensor_name(series_id);
+    if (!fleet_partition.owns(machine_id)) {
+        return current_time + max_expected_delay; // A máquina passou para outra instância
+    }
+
+    // Gerar alarme se o atraso for maior do que o esperado
+    if (!sensor.absent.exchange(true, std::memory_order_relaxed)) {
+        if (log_enabled(LogLevel::Warn)) {
+            logger.push(LogLevel::Warn, LogEvent::InactivityAlarm, [&](LogRecord& record) {
+                record.machine = &machine_id;
+                record.sensor = &sensor_name;
+                record.rule = &sensor.rules->absence_name;
+            });
+        }
+        post_metric(machine_id, sensor.rules->absence_metric, current_time, 1);
+    }
+    return current_time + max_expected_delay;
+}
+
+// Chamado pelo worker a cada amostra: se a série estava com o alarme de
+// inatividade disparado, ele é normalizado
+void clear_absence(const std::string& machine_id, const std::string& sensor_id, SeriesInfo& sensor,
+    std::time_t timestamp) {
+    if (!sensor.absent.load(std::memory_order_relaxed) || !sensor.absent.exchange(false, std::memory_order_relaxed)) {
+        return;
+    }
+    post_metric(machine_id, sensor.rules->absence_metric, timestamp, 0);
+    if (log_enabled(LogLevel::Warn)) {
+        logger.push(LogLevel::Warn, LogEvent::AlarmCleared, [&](LogRecord& record) {
+            record.machine = &machine_id;
+            record.sensor = &sensor_id;
+            record.rule = &sensor.rules->absence_name;
+        });
+    }
+}
+
+#define TIMER_WHEEL_SLOTS 512 // Cada slot corresponde a um segundo
+
+// Roda de temporizadores (hashed timing wheel) com os prazos de inatividade de
+// todos os sensores, atendida por uma única thread. Um prazo cai no slot
+// deadline % TIMER_WHEEL_SLOTS; prazos mais distantes que uma volta completa
+// permanecem no slot até a volta certa. A chegada de dados não mexe na roda:
+// apenas atualiza o last_timestamp da série, e o prazo é adiado quando vence.
+class InactivityScheduler {
+public:
+    ~InactivityScheduler() {
+        stop();
+    }
+
+    void start() {
+        current_tick = std::time(nullptr);
+        running = true;
+        scheduler_thread = std::thread(&InactivityScheduler::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(wheel_mtx);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        wheel_cv.notify_one();
+        if (scheduler_thread.joinable()) {
+            scheduler_thread.join();
+        }
+    }
+
+    void schedule(uint32_t series_id, std::time_t deadline) {
+        std::lock_guard<std::mutex> lock(wheel_mtx);
+        insert(series_id, deadline);
+    }
+
+private:
+    struct Timer {
+        uint32_t series_id;
+        std::time_t deadline;
+    };
+
+    void insert(uint32_t series_id, std::time_t deadline) {
+        // Um prazo já vencido é tratado no próximo tick
+        deadline = std::max(deadline, current_tick + 1);
+        wheel[static_cast<size_t>(deadline) % TIMER_WHEEL_SLOTS].push_back({series_id, deadline});
+    }
+
+    void run() {
+        std::vector<Timer> expired;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(wheel_mtx);
+                wheel_cv.wait_for(lock, std::chrono::seconds(1), [this] { return !running; });
+                if (!running) {
+                    return;
+                }
+
+                // Percorre os slots desde o último tick (no máximo uma volta completa)
+                std::time_t now = std::time(nullptr);
+                std::time_t first = std::max(current_tick + 1, now - TIMER_WHEEL_SLOTS + 1);
+                for (std::time_t tick = first; tick <= now; ++tick) {
+                    auto& slot = wheel[static_cast<size_t>(tick) % TIMER_WHEEL_SLOTS];
+                    auto pending = std::partition(slot.begin(), slot.end(), [now](const Timer& timer) {
+                        return timer.deadline > now;
+                    });
+                    expired.insert(expired.end(), pending, slot.end());
+                    slot.erase(pending, slot.end());
+                }
+                current_tick = std::max(current_tick, now);
+            }
+
+            // Os alarmes são tratados fora da trava da roda
+            for (const Timer& timer : expired) {
+                std::time_t next_deadline = process_sensor_alarm(timer.series_id);
+                schedule(timer.series_id, next_deadline);
+            }
+            expired.clear();
+        }
+    }
+
+    std::vector<std::vector<Timer>> wheel = std::vector<std::vector<Timer>>(TIMER_WHEEL_SLOTS);
+    std::time_t current_tick = 0;
+    std::mutex wheel_mtx;
+    std::condition_variable wheel_cv;
+    bool running = false;
+    std::thread scheduler_thread;
+};
+
+InactivityScheduler inactivity_scheduler;
+
+std::vector<std::string> split(const std::string &str, char delim) {
+    std::vector<std::string> tokens;
+    std::string token;
+    std::istringstream tokenStream(str);
+    while (std::getline(tokenStream, token, delim)) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+// --replay: sem alarmes de inatividade, e a frota é agregada pelo relógio das amostras
+bool replaying_capture = false;
+std::atomic<std::time_t> replay_arrival{0}; // Chegada original da mensagem em reprodução
+
+// Registra a série na primeira amostra, agendando seu prazo de inatividade, e devolve o seu id
+uint32_t track_series(std::string_view machine_id, std::string_view sensor_id, std::time_t timestamp) {
+    bool created;
+    uint32_t series_id = sensor_registry.find_or_add(machine_id, sensor_id, timestamp, created);
+    if (created && !replaying_capture && per_series_analytics()) {
+        std::time_t timeout = sensor_registry.series(series_id).inactivity_timeout_s.load(std::memory_order_relaxed);
+        if (timeout > 0) {
+            inactivity_scheduler.schedule(series_id, timestamp + timeout + 1);
+        }
+    }
+    return series_id;
+}
+
+// Registra uma série anunciada em /sensor_monitors antes da sua primeira amostra.
+// Sem prazo definido na configuração, o de inatividade passa a ser o maior
+// intervalo anunciado entre mensagens vezes announced_missed_intervals. Um novo
+// prazo vale a partir do próximo vencimento do atual.
+uint32_t provision_series(std::string_view machine_id, std::string_view sensor_id,
+    std::chrono::milliseconds max_gap, bool& created) {
+    std::time_t now = std::time(nullptr);
+    uint32_t series_id = sensor_registry.find_or_add(machine_id, sensor_id, now, created);
+    SeriesInfo& info = sensor_registry.series(series_id);
+    if (info.rules->absence.count() > 0 && info.rules->absence_follows_announcement) {
+        int64_t timeout_ms = max_gap.count() * config.announced_missed_intervals;
+        info.inactivity_timeout_s.store(std::max<int64_t>(1, (timeout_ms + 999) / 1000), std::memory_order_relaxed);
+    }
+    if (created && per_series_analytics()) {
+        std::time_t timeout = info.inactivity_timeout_s.load(std::memory_order_relaxed);
+        if (timeout > 0) {
+            inactivity_scheduler.schedule(series_id, now + timeout + 1);
+        }
+    }
+    return series_id;
+}
+
+// DECODIFICAÇÃO DE MENSAGENS ------------------------------------------------------------------------------------
+
+struct SensorReading {
+    std::time_t timestamp;
+    double value;
+};
+
+// Extrai machine_id e sensor_id de "/sensors/<machine_id>/<sensor_id>" sem alocar
+bool parse_sensor_topic(std::string_view topic, std::string_view& machine_id, std::string_view& sensor_id) {
+    constexpr std::string_view prefix = "/sensors/";
+    if (topic.substr(0, prefix.size()) != prefix) {
+        return false;
+    }
+    topic.remove_prefix(prefix.size());
+    size_t slash = topic.find('/');
+    if (slash == std::string_view::npos || slash == 0 || slash + 1 == topic.size() ||
+        topic.find('/', slash + 1) != std::string_view::npos) {
+        return false;
+    }
+    machine_id = topic.substr(0, slash);
+    sensor_id = topic.substr(slash + 1);
+    return true;
+}
+
+void skip_whitespace(std::string_view text, size_t& pos) {
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) {
+        ++pos;
+    }
+}
+
+// Lê um número JSON (sem '+' nem espaços à frente). Sem std::from_chars para
+// double (libstdc++ anterior ao GCC 11), usa strtod sobre uma cópia terminada em NUL.
+bool read_number(std::string_view text, size_t& pos, double& value) {
+    if (pos >= text.size() || (text[pos] != '-' && (text[pos] < '0' || text[pos] > '9'))) {
+        return false;
+    }
+#if defined(__cpp_lib_to_chars)
+    auto result = std::from_chars(text.data() + pos, text.data() + text.size(), value);
+    if (result.ec != std::errc()) {
+        return false;
+    }
+    pos = static_cast<size_t>(result.ptr - text.data());
+#else
+    char number[64];
+    size_t length = std::min(text.size() - pos, sizeof(number) - 1);
+    std::memcpy(number, text.data() + pos, length);
+    number[length] = '\0';
+    char* end;
+    errno = 0;
+    value = std::strtod(number, &end);
+    if (end == number || errno == ERANGE) {
+        return false;
+    }
+    pos += static_cast<size_t>(end - number);
+#endif
+    return true;
+}
+
+// Lê uma string JSON sem sequências de escape; as demais ficam para o caminho genérico
+bool read_plain_string(std::string_view text, size_t& pos, std::string_view& out) {
+    if (pos >= text.size() || text[pos] != '"') {
+        return false;
+    }
+    size_t end = pos + 1;
+    while (end < text.size() && text[end] != '"') {
+        if (text[end] == '\\') {
+            return false;
+        }
+        ++end;
+    }
+    if (end == text.size()) {
+        return false;
+    }
+    out = text.substr(pos + 1, end - pos - 1);
+    pos = end + 1;
+    return true;
+}
+
+// Decodificador especializado para o formato {"timestamp": "...", "value": <número>},
+// trabalhando diretamente sobre o payload. Retorna false para qualquer coisa fora
+// desse esquema, que então segue pelo parser JSON completo.
+bool decode_sensor_reading(std::string_view payload, SensorReading& reading) {
+    bool has_timestamp = false, has_value = false;
+    size_t pos = 0;
+    skip_whitespace(payload, pos);
+    if (pos >= payload.size() || payload[pos++] != '{') {
+        return false;
+    }
+
+    while (true) {
+        std::string_view key;
+        skip_whitespace(payload, pos);
+        if (!read_plain_string(payload, pos, key)) {
+            return false;
+        }
+        skip_whitespace(payload, pos);
+        if (pos >= payload.size() || payload[pos++] != ':') {
+            return false;
+        }
+        skip_whitespace(payload, pos);
+
+        if (key == "timestamp" && !has_timestamp) {
+            std::string_view timestamp;
+            if (!read_plain_string(payload, pos, timestamp) || !parse_iso8601_utc(timestamp, reading.timestamp)) {
+                return false;
+            }
+            has_timestamp = true;
+        } else if (key == "value" && !has_value) {
+            if (!read_number(payload, pos, reading.value)) {
+                return false;
+            }
+            has_value = true;
+        } else {
+            return false;
+        }
+
+        skip_whitespace(payload, pos);
+        if (pos >= payload.size()) {
+            return false;
+        }
+        char separator = payload[pos++];
+        if (separator == '}') {
+            break;
+        } else if (separator != ',') {
+            return false;
+        }
+    }
+
+    skip_whitespace(payload, pos);
+    return pos == payload.size() && has_timestamp && has_value;
+}
+
+// Caminho genérico: parser JSON completo, para payloads fora do formato esperado
+bool decode_sensor_reading_generic(const std::string& payload, SensorReading& reading) {
+    try {
+        auto j = nlohmann::json::parse(payload);
+        std::string timestamp = j.at("timestamp");
+        reading.timestamp = string_to_time_t(timestamp);
+        reading.value = j.at("value");
+        return true;
+    } catch (const nlohmann::json::exception& e) {
+        log_text(LogLevel::Error, "Error: Invalid sensor message: ", e.what());
+        return false;
+    }
+}
+
+// Lotes enviados pelo sensor_monitor no modo em lote: [[epoch_ms, valor], ...],
+// em JSON compacto ou em CBOR precedido da tag 0xd9d9f7. As amostras são
+// acrescentadas a `readings`, que o chamador reaproveita entre mensagens.
+constexpr std::string_view CBOR_SELF_DESCRIBE_TAG = "\xd9\xd9\xf7";
+
+bool is_batch_frame(std::string_view payload) {
+    size_t pos = 0;
+    skip_whitespace(payload, pos);
+    return (pos < payload.size() && payload[pos] == '[') || payload.substr(0, 3) == CBOR_SELF_DESCRIBE_TAG;
+}
+
+bool decode_json_batch(std::string_view payload, std::vector<SensorReading>& readings) {
+    size_t pos = 0;
+    skip_whitespace(payload, pos);
+    if (pos >= payload.size() || payload[pos++] != '[') {
+        return false;
+    }
+    skip_whitespace(payload, pos);
+    if (pos < payload.size() && payload[pos] == ']') {
+        ++pos;
+    } else {
+        while (true) {
+            std::int64_t timestamp_ms;
+            SensorReading reading;
+            skip_whitespace(payload, pos);
+            if (pos >= payload.size() || payload[pos++] != '[') {
+                return false;
+            }
+            skip_whitespace(payload, pos);
+            auto ts_result = std::from_chars(payload.data() + pos, payload.data() + payload.size(), timestamp_ms);
+            if (ts_result.ec != std::errc()) {
+                return false;
+            }
+            pos = static_cast<size_t>(ts_result.ptr - payload.data());
+            skip_whitespace(payload, pos);
+            if (pos >= payload.size() || payload[pos++] != ',') {
+                return false;
+            }
+            skip_whitespace(payload, pos);
+            if (!read_number(payload, pos, reading.value)) {
+                return false;
+            }
+            skip_whitespace(payload, pos);
+            if (pos >= payload.size() || payload[pos++] != ']') {
+                return false;
+            }
+            reading.timestamp = static_cast<std::time_t>(timestamp_ms / 1000);
+            readings.push_back(reading);
+
+            skip_whitespace(payload, pos);
+            if (pos >= payload.size()) {
+                return false;
+            }
+            char separator = payload[pos++];
+            if (separator == ']') {
+                break;
+            } else if (separator != ',') {
+                return false;
+            }
+        }
+    }
+    skip_whitespace(payload, pos);
+    return pos == payload.size();
+}
+
+// Lê o cabeçalho de um item CBOR (tipo principal e argumento); não aceita tamanhos indefinidos
+bool read_cbor_head(std::string_view data, size_t& pos, int& major, uint64_t& argument) {
+    if (pos >= data.size()) {
+        return false;
+    }
+    uint8_t initial = static_cast<uint8_t>(data[pos++]);
+    major = initial >> 5;
+    uint8_t info = initial & 0x1f;
+    if (info < 24) {
+        argument = info;
+        return true;
+    }
+    if (info > 27) {
+        return false;
+    }
+    size_t length = size_t(1) << (info - 24);
+    if (pos + length > data.size()) {
+        return false;
+    }
+    argument = 0;
+    for (size_t i = 0; i < length; ++i) {
+        argument = (argument << 8) | static_cast<uint8_t>(data[pos + i]);
+    }
+    pos += length;
+    return true;
+}
+
+// Converte um número CBOR (inteiro ou ponto flutuante de 16, 32 ou 64 bits) para double
+bool read_cbor_number(std::string_view data, size_t& pos, double& value) {
+    if (pos >= data.size()) {
+        return false;
+    }
+    uint8_t initial = static_cast<uint8_t>(data[pos]);
+    int major;
+    uint64_t argument;
+    if (!read_cbor_head(data, pos, major, argument)) {
+        return false;
+    }
+    if (major == 0) {
+        value = static_cast<double>(argument);
+    } else if (major == 1) {
+        value = -1.0 - static_cast<double>(argument);
+    } else if (initial == 0xf9) {
+        int exponent = (argument >> 10) & 0x1f;
+        double mantissa = static_cast<double>(argument & 0x3ff);
+        double magnitude = exponent == 0 ? std::ldexp(mantissa, -24)
+                         : exponent == 31 ? (mantissa == 0 ? INFINITY : NAN)
+                         : std::ldexp(mantissa + 1024, exponent - 25);
+        value = (argument & 0x8000) ? -magnitude : magnitude;
+    } else if (initial == 0xfa) {
+        uint32_t bits = static_cast<uint32_t>(argument);
+        float single;
+        std::memcpy(&single, &bits, sizeof(single));
+        value = single;
+    } else if (initial == 0xfb) {
+        std::memcpy(&value, &argument, sizeof(value));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool decode_cbor_batch(std::string_view payload, std::vector<SensorReading>& readings) {
+    if (payload.substr(0, 3) != CBOR_SELF_DESCRIBE_TAG) {
+        return false;
+    }
+    size_t pos = 3;
+    int major;
+    uint64_t count;
+    if (!read_cbor_head(payload, pos, major, count) || major != 4) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t pair_size, timestamp_ms;
+        SensorReading reading;
+        if (!read_cbor_head(payload, pos, major, pair_size) || major != 4 || pair_size != 2 ||
+            !read_cbor_head(payload, pos, major, timestamp_ms) || major != 0 ||
+            !read_cbor_number(payload, pos, reading.value)) {
+            return false;
+        }
+        reading.timestamp = static_cast<std::time_t>(timestamp_ms / 1000);
+        readings.push_back(reading);
+    }
+    return pos == payload.size();
+}
+
+bool decode_batch(std::string_view payload, std::vector<SensorReading>& readings) {
+    size_t first = readings.size();
+    bool ok = payload.substr(0, 3) == CBOR_SELF_DESCRIBE_TAG ? decode_cbor_batch(payload, readings)
+                                                             : decode_json_batch(payload, readings);
+    if (!ok) {
+        readings.resize(first); // não aproveita lotes parcialmente decodificados
+        log_text(LogLevel::Error, "Error: Invalid sensor batch message");
+    }
+    return ok;
+}
+
+// AGREGAÇÃO DA FROTA ------------------------------------------------------------------------------------------
+
+#define FLEET_REPLAY_MAX_SKEW_S 3600 // Na reprodução, amostras mais adiantadas que isso em relação à chegada ficam fora da frota
+
+// Árvore de segmentos de máximos sobre os valores de uma coluna. Atualizar uma
+// máquina custa O(log n) e os k maiores saem em O(k log n), sem ordenar a coluna.
+class MaxTree {
+public:
+    void update(size_t index, double value) {
+        if (index >= leaves) {
+            grow(index + 1);
+        }
+        size_t node = leaves + index;
+        nodes[node] = value;
+        for (node /= 2; node >= 1; node /= 2) {
+            nodes[node] = std::max(nodes[2 * node], nodes[2 * node + 1]);
+        }
+    }
+
+    // Índices e valores dos k maiores, em ordem decrescente
+    void top(size_t k, std::vector<std::pair<double, size_t>>& out) const {
+        out.clear();
+        if (leaves == 0) {
+            return;
+        }
+        // Fronteira de subárvores ordenada pelo máximo de cada uma
+        std::vector<std::pair<double, size_t>> frontier = {{nodes[1], 1}};
+        while (!frontier.empty() && out.size() < k) {
+            std::pop_heap(frontier.begin(), frontier.end());
+            auto [value, node] = frontier.back();
+            frontier.pop_back();
+            if (value == -std::numeric_limits<double>::infinity()) {
+                break;
+            }
+            if (node >= leaves) {
+                out.emplace_back(value, node - leaves);
+                continue;
+            }
+            for (size_t child : {2 * node, 2 * node + 1}) {
+                frontier.emplace_back(nodes[child], child);
+                std::push_heap(frontier.begin(), frontier.end());
+            }
+        }
+    }
+
+private:
+    void grow(size_t minimum) {
+        size_t new_leaves = std::max<size_t>(leaves, 64);
+        while (new_leaves < minimum) {
+            new_leaves *= 2;
+        }
+        std::vector<double> grown(2 * new_leaves, -std::numeric_limits<double>::infinity());
+        std::copy(nodes.begin() + leaves, nodes.begin() + 2 * leaves, grown.begin() + new_leaves);
+        nodes.swap(grown);
+        leaves = new_leaves;
+        for (size_t node = leaves - 1; node >= 1; --node) {
+            nodes[node] = std::max(nodes[2 * node], nodes[2 * node + 1]);
+        }
+    }
+
+    size_t leaves = 0;
+    std::vector<double> nodes; // nodes[1] é a raiz; as folhas começam em nodes[leaves]
+};
+
+// Agregados parciais de um tipo de sensor, calculados por um worker sobre as suas máquinas
+struct FleetPartial {
+    uint32_t sensor = 0;
+    double sum = 0.0;
+    uint64_t count = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    uint64_t over_threshold = 0;
+    std::vector<std::pair<double, uint32_t>> top; // (valor, id da máquina)
+};
+
+// Último valor de cada máquina para um tipo de sensor, em colunas (struct of
+// arrays). Pertence a um único worker; a posição de uma máquina é o seu id
+// dividido pelo número de workers, já que cada worker atende os ids congruentes
+// ao seu índice.
+class FleetColumn {
+public:
+    explicit FleetColumn(double over_threshold) : threshold(over_threshold) {}
+
+    void update(size_t slot, double value, std::time_t arrival) {
+        if (slot >= values.size()) {
+            values.resize(slot + 1, 0.0);
+            valid.resize(slot + 1, 0.0);
+            updated.resize(slot + 1, 0);
+        }
+        values[slot] = value;
+        valid[slot] = 1.0;
+        updated[slot] = arrival;
+        tree.update(slot, value);
+    }
+
+    // Abre espaço para uma máquina anunciada; a posição fica vazia até a primeira leitura
+    void reserve(size_t slot) {
+        if (slot >= values.size()) {
+            values.resize(slot + 1, 0.0);
+            valid.resize(slot + 1, 0.0);
+            updated.resize(slot + 1, 0);
+            tree.update(slot, -std::numeric_limits<double>::infinity());
+        }
+    }
+
+    // Varre a coluna com quatro acumuladores independentes, que quebram a
+    // dependência entre iterações e deixam o compilador juntar as quatro em
+    // instruções vetoriais sem reordenar as somas. Posições vazias guardam 0 e a
+    // coluna valid (0 ou 1) entra como máscara: o corpo do laço não tem desvios.
+    void aggregate(std::time_t stale_before, size_t top_k, size_t worker_index, size_t worker_count,
+        FleetPartial& partial) {
+        const double inf = std::numeric_limits<double>::infinity();
+        const size_t n = values.size();
+        for (size_t i = 0; i < n; ++i) {
+            if (updated[i] < stale_before && valid[i] != 0.0) {
+                values[i] = 0.0; // Máquina parou de enviar: sai dos agregados e do ranking
+                valid[i] = 0.0;
+                tree.update(i, -inf);
+            }
+        }
+
+        double sum[4] = {0, 0, 0, 0};
+        double count[4] = {0, 0, 0, 0};
+        double over[4] = {0, 0, 0, 0};
+        double low[4] = {inf, inf, inf, inf};
+        double high[4] = {-inf, -inf, -inf, -inf};
+        const double* v = values.data();
+        const double* m = valid.data();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+#pragma GCC unroll 1
+            for (int lane = 0; lane < 4; ++lane) {
+                double value = v[i + lane];
+                double mask = m[i + lane];
+                sum[lane] += value;
+                count[lane] += mask;
+                over[lane] += value > threshold ? mask : 0.0;
+                double as_low = mask > 0.0 ? value : inf;
+                double as_high = mask > 0.0 ? value : -inf;
+                low[lane] = as_low < low[lane] ? as_low : low[lane];
+                high[lane] = as_high > high[lane] ? as_high : high[lane];
+            }
+        }
+        for (; i < n; ++i) {
+            if (m[i] > 0.0) {
+                sum[0] += v[i];
+                count[0] += 1.0;
+                over[0] += v[i] > threshold ? 1.0 : 0.0;
+                low[0] = std::min(low[0], v[i]);
+                high[0] = std::max(high[0], v[i]);
+            }
+        }
+        for (int lane = 0; lane < 4; ++lane) {
+            partial.sum += sum[lane];
+            partial.count += static_cast<uint64_t>(count[lane]);
+            partial.over_threshold += static_cast<uint64_t>(over[lane]);
+            partial.min = std::min(partial.min, low[lane]);
+            partial.max = std::max(partial.max, high[lane]);
+        }
+
+        tree.top(top_k, top_slots);
+        partial.top.clear();
+        for (const auto& [value, slot] : top_slots) {
+            partial.top.emplace_back(value, static_cast<uint32_t>(slot * worker_count + worker_index));
+        }
+    }
+
+private:
+    double threshold;
+    std::vector<double> values;     // 0 nas posições sem leitura recente
+    std::vector<double> valid;      // 1 se a posição tem leitura recente, 0 se não
+    std::vector<std::time_t> updated;
+    MaxTree tree;
+    std::vector<std::pair<double, size_t>> top_slots;
+};
+
+// Junta os parciais de todos os workers de um mesmo intervalo e envia os
+// agregados como fleet.<sensor>.{avg,min,max,sum,count,over_threshold} e
+// fleet.<sensor>.top.<máquina>. Quem fecha o intervalo é o último worker a
+// entregar os seus parciais; se algum atrasar a ponto de o próximo intervalo
+// começar, o anterior é enviado com o que chegou.
+class FleetAggregator {
+public:
+    // Na reprodução (ordered) os workers avançam no relógio das amostras, cada um
+    // no seu ritmo: um intervalo só é enviado quando todos já passaram dele
+    void start(size_t workers, size_t top_k, std::chrono::seconds interval, bool ordered) {
+        worker_count = workers;
+        k = top_k;
+        interval_s = interval.count();
+        wait_for_all = ordered;
+        worker_epochs.assign(workers, -1);
+    }
+
+    void submit(size_t worker, int64_t epoch, std::vector<FleetPartial>& partials) {
+        std::lock_guard<std::mutex> lock(fleet_mtx);
+        if (wait_for_all) {
+            for (FleetPartial& partial : partials) {
+                merge(pending[epoch], partial);
+            }
+            worker_epochs[worker] = epoch;
+            publish_completed();
+            return;
+        }
+        if (epoch < current_epoch) {
+            return;
+        }
+        if (epoch > current_epoch) {
+            if (received > 0) {
+                publish(current_epoch, totals);
+            }
+            current_epoch = epoch;
+        }
+        for (FleetPartial& partial : partials) {
+            merge(totals, partial);
+        }
+        if (++received == worker_count) {
+            publish(current_epoch, totals);
+        }
+    }
+
+    // Parciais entregues pelos workers ao encerrar; o último a chegar envia o intervalo em curso
+    void submit_final(size_t worker, int64_t epoch, std::vector<FleetPartial>& partials) {
+        std::lock_guard<std::mutex> lock(fleet_mtx);
+        if (wait_for_all) {
+            worker_epochs[worker] = std::numeric_limits<int64_t>::max(); // não envia mais intervalos
+            publish_completed();
+        } else if (received > 0) {
+            publish(current_epoch, totals);
+        }
+        for (FleetPartial& partial : partials) {
+            merge(final_totals, partial);
+        }
+        final_epoch = std::max(final_epoch, epoch);
+        if (++final_received == worker_count) {
+            publish(final_epoch, final_totals);
+        }
+    }
+
+    // Resposta do comando "fleet" do socket de estatísticas
+    std::string last_report() {
+        std::lock_guard<std::mutex> lock(fleet_mtx);
+        return report.empty() ? "no fleet aggregates yet\n" : report;
+    }
+
+private:
+    using Totals = std::unordered_map<uint32_t, FleetPartial>;
+
+    void merge(Totals& into, FleetPartial& partial) {
+        FleetPartial& total = into[partial.sensor];
+        total.sensor = partial.sensor;
+        total.sum += partial.sum;
+        total.count += partial.count;
+        total.min = std::min(total.min, partial.min);
+        total.max = std::max(total.max, partial.max);
+        total.over_threshold += partial.over_threshold;
+        total.top.insert(total.top.end(), partial.top.begin(), partial.top.end());
+    }
+
+    // Envia, em ordem, os intervalos pelos quais todos os workers já passaram
+    void publish_completed() {
+        int64_t completed = *std::min_element(worker_epochs.begin(), worker_epochs.end());
+        while (!pending.empty() && pending.begin()->first <= completed) {
+            publish(pending.begin()->first, pending.begin()->second);
+            pending.erase(pending.begin());
+        }
+    }
+
+    void publish(int64_t epoch, Totals& sums) {
+        std::time_t timestamp = static_cast<std::time_t>(epoch * interval_s);
+        std::ostringstream text;
+        for (auto& [sensor, total] : sums) {
+            if (total.count == 0) {
+                continue;
+            }
+            const std::string& sensor_id = sensor_registry.sensors.name(sensor);
+            std::string prefix = "fleet." + (instance_metric_id.empty() ? "" : instance_metric_id + ".") + sensor_id + ".";
+            post_graphite_metric(prefix + "avg", timestamp, total.sum / total.count);
+            post_graphite_metric(prefix + "min", timestamp, total.min);
+            post_graphite_metric(prefix + "max", timestamp, total.max);
+            post_graphite_metric(prefix + "sum", timestamp, total.sum);
+            post_graphite_metric(prefix + "count", timestamp, static_cast<double>(total.count));
+            if (config.fleet_thresholds.count(sensor_id)) {
+                post_graphite_metric(prefix + "over_threshold", timestamp, static_cast<double>(total.over_threshold));
+            }
+
+            // Os k maiores de cada worker contêm os k maiores da frota
+            size_t top_size = std::min(k, total.top.size());
+            std::partial_sort(total.top.begin(), total.top.begin() + top_size, total.top.end(),
+                              [](const auto& a, const auto& b) { return a.first > b.first; });
+            text << sensor_id << ": avg " << total.sum / total.count << " min " << total.min << " max " << total.max
+                 << " count " << total.count << " over_threshold " << total.over_threshold << "\n";
+            for (size_t i = 0; i < top_size; ++i) {
+                const std::string& machine_id = sensor_registry.machines.name(total.top[i].second);
+                post_graphite_metric(prefix + "top." + machine_id, timestamp, total.top[i].first);
+                text << "  " << i + 1 << ". " << machine_id << " " << total.top[i].first << "\n";
+            }
+        }
+        report = text.str();
+        sums.clear();
+        received = 0;
+    }
+
+    size_t worker_count = 0;
+    size_t k = 0;
+    int64_t interval_s = 0;
+    bool wait_for_all = false;
+    std::mutex fleet_mtx;
+    int64_t current_epoch = 0;
+    size_t received = 0;
+    size_t final_received = 0;
+    int64_t final_epoch = 0;
+    Totals totals;
+    Totals final_totals;
+    std::map<int64_t, Totals> pending;  // reprodução: intervalos à espera dos workers atrasados
+    std::vector<int64_t> worker_epochs; // reprodução: último intervalo enviado por cada worker
+    std::string report;
+};
+
+FleetAggregator fleet_aggregator;
+
+// PIPELINE DE PROCESSAMENTO -------------------------------------------------------------------------------------
+
+// Fila limitada sem travas com múltiplos produtores e consumidores (algoritmo de
+// Dmitry Vyukov). Cada célula tem um número de sequência que indica se está livre
+// para o produtor da volta atual ou pronta para o consumidor. Os elementos são
+// preenchidos e consumidos no próprio lugar, reaproveitando a memória das células.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t min_capacity) {
+        size_t capacity = 1;
+        while (capacity < min_capacity) {
+            capacity <<= 1;
+        }
+        cells = std::vector<Cell>(capacity);
+        mask = capacity - 1;
+        for (size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Chama fill(T&) sobre uma célula livre; retorna false se a fila estiver cheia
+    template <typename Fill>
+    bool try_push(Fill&& fill) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    fill(cell.data);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Chama consume(T&) sobre o elemento mais antigo; retorna false se a fila estiver vazia
+    template <typename Consume>
+    bool try_pop(Consume&& consume) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    consume(cell.data);
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
-#define QOS 1
-#define BROKER_ADDRESS "tcp://localhost:1883"
-#define GRAPHITE_HOST "127.0.0.1"
-#define GRAPHITE_PORT 2003
+    size_t size() const {
+        size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        return tail >= head ? tail - head : 0;
+    }
 
-// Definição de cores ANSI para o console
-#define RESET   "\033[0m"
-#define RED     "\033[31m"      /* Red */
+private:
+    struct alignas(64) Cell {
+        std::atomic<size_t> sequence{0};
+        T data;
+    };
 
-// CÁLCULO E CONVERSÃO -------------------------------------------------------------------------------------------
+    std::vector<Cell> cells;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
 
-std::time_t string_to_time_t(const std::string& time_string) {
-    std::tm tm = {};
-    std::istringstream ss(time_string);
-    ss >> std::get_time(&tm, "%Y-%m-%dT%H:%M:%S");
-    return std::mktime(&tm);
-}
+struct Sample {
+    uint32_t series_id = 0;
+    std::time_t timestamp = 0;
+    double value = 0.0;
+    int64_t enqueued_ns = 0; // Para medir a espera na fila
+    bool provision = false;  // Série anunciada: só prepara o estado, sem amostra
+};
 
-std::tm string_to_tm(const std::string& timestamp) {
-    std::tm tm = {};
-    std::istringstream ss(timestamp);
-    ss >> std::get_time(&tm, "%Y-%m-%dT%H:%M:%SZ");
-    return tm;
-}
+// Consome as amostras de um subconjunto das máquinas. Como cada máquina é sempre
+// atendida pelo mesmo worker, o estado das suas séries é acessado por uma única
+// thread e não precisa de trava.
+class ProcessingWorker {
+public:
+    ProcessingWorker(size_t queue_capacity, size_t index, size_t count)
+        : queue(queue_capacity), worker_index(index), worker_count(count) {}
 
-// Defina o tamanho da janela para a média móvel
-const size_t MOVING_AVERAGE_WINDOW = 5; // Por exemplo, uma janela de tamanho 5
+    ~ProcessingWorker() {
+        stop();
+    }
 
-// Função para calcular a média móvel de um conjunto de valores
-double calculateMovingAverage(const std::deque<double>& values) {
-    if (values.empty()) {
-        return 0.0; // Se a fila estiver vazia, retorna 0 como média móvel
+    void start() {
+        running = true;
+        worker_thread = std::thread(&ProcessingWorker::run, this);
     }
 
-    double sum = 0.0;
-    for (const auto& value : values) {
-        sum += value;
+    // Para a thread depois de processar o que já estava na fila
+    void stop() {
+        running = false;
+        if (worker_thread.joinable()) {
+            worker_thread.join();
+        }
     }
 
-    return sum / static_cast<double>(values.size());
-}
+    BoundedQueue<Sample> queue;
 
+private:
+    void run() {
+        std::chrono::microseconds idle_sleep(0);
+        uint32_t since_sweep_check = 0;
+        while (running.load(std::memory_order_relaxed)) {
+            bool got_sample = queue.try_pop([this](Sample& sample) {
+                process(sample);
+            });
+            if (!got_sample || ++since_sweep_check == 1024) {
+                since_sweep_check = 0;
+                sweep_rollups();
+                aggregate_fleet(false);
+            }
+            if (got_sample) {
+                idle_sleep = std::chrono::microseconds(0);
+                continue;
+            }
 
-// Função para calcular o Z-score de um valor em relação a um conjunto de dados
-double calculateZScore(double value, const std::deque<double>& values) {
-    if (values.empty()) {
-        return 0.0; // Se a fila estiver vazia, retorna 0 como Z-score
+            // Fila vazia: cede a CPU e vai espaçando as verificações até 1 ms
+            if (idle_sleep.count() == 0) {
+                std::this_thread::yield();
+                idle_sleep = std::chrono::microseconds(50);
+            } else {
+                std::this_thread::sleep_for(idle_sleep);
+                idle_sleep = std::min(idle_sleep * 2, std::chrono::microseconds(1000));
+            }
+        }
+        while (queue.try_pop([this](Sample& sample) {
+            process(sample);
+        })) {
+        }
+
+        // Encerrando (fim de uma reprodução, por exemplo): envia também os intervalos incompletos
+        for (auto& [series_id, state] : series_states) {
+            flush_rollups(sensor_registry.machine_name(series_id), sensor_registry.sensor_name(series_id), state,
+                          std::numeric_limits<std::time_t>::max() - ROLLUP_GRACE_S);
+        }
+        aggregate_fleet(true);
+    }
+
+    // Relógio da frota: o local ao vivo e o das amostras durante uma reprodução
+    std::time_t fleet_clock() const {
+        return replaying_capture ? sample_clock : std::time(nullptr);
     }
 
-    double mean = calculateMovingAverage(values);
-    double variance = 0.0;
+    // Ao virar o intervalo da frota, calcula os parciais das máquinas deste worker
+    void aggregate_fleet(bool final) {
+        if (config.fleet_interval.count() == 0 || (replaying_capture && sample_clock == 0 && !final)) {
+            return;
+        }
+        std::time_t now = fleet_clock();
+        int64_t interval = config.fleet_interval.count();
+        int64_t epoch = now / interval;
+        if (!final && epoch == fleet_epoch) {
+            return;
+        }
+        bool first_pass = fleet_epoch < 0;
+        int64_t previous_epoch = fleet_epoch;
+        fleet_epoch = epoch;
+        if (first_pass && !final) {
+            return; // Só o primeiro intervalo completo é enviado
+        }
 
-    for (const auto& val : values) {
-        variance += std::pow(val - mean, 2);
+        std::vector<FleetPartial> partials;
+        if (final) {
+            fleet_partials(now, partials);
+            fleet_aggregator.submit_final(worker_index, epoch, partials);
+        } else if (replaying_capture) {
+            // O relógio das amostras salta: cada intervalo atravessado é enviado, como seria ao vivo.
+            // Passado fleet_stale_after sem amostras todas as máquinas estão vencidas e os
+            // intervalos seguintes sairiam vazios, então um salto longo pula direto para o atual
+            int64_t last_with_data = previous_epoch + 1 + (config.fleet_stale_after.count() + interval - 1) / interval;
+            for (int64_t crossed = previous_epoch + 1; crossed <= epoch; ++crossed) {
+                if (crossed > last_with_data) {
+                    crossed = epoch;
+                }
+                fleet_partials(crossed * interval, partials);
+                fleet_aggregator.submit(worker_index, crossed, partials);
+            }
+        } else {
+            fleet_partials(now, partials);
+            fleet_aggregator.submit(worker_index, epoch, partials);
+        }
     }
 
-    variance /= static_cast<double>(values.size());
-    double stdDeviation = std::sqrt(variance);
+    void fleet_partials(std::time_t now, std::vector<FleetPartial>& partials) {
+        partials.clear();
+        partials.reserve(fleet_columns.size());
+        for (auto& [sensor, column] : fleet_columns) {
+            FleetPartial& partial = partials.emplace_back();
+            partial.sensor = sensor;
+            column.aggregate(now - config.fleet_stale_after.count(), config.fleet_top_k, worker_index, worker_count,
+                             partial);
+        }
+    }
 
-    if (stdDeviation == 0.0) {
-        return 0.0; // Retorna 0 se o desvio padrão for zero para evitar divisão por zero
+    FleetColumn& get_fleet_column(uint32_t sensor, const std::string& sensor_id) {
+        auto it = fleet_columns.find(sensor);
+        if (it == fleet_columns.end()) {
+            auto threshold = config.fleet_thresholds.find(sensor_id);
+            it = fleet_columns.emplace(sensor, FleetColumn(threshold != config.fleet_thresholds.end()
+                ? threshold->second : std::numeric_limits<double>::infinity())).first;
+        }
+        return it->second;
     }
 
-    return (value - mean) / stdDeviation;
-}
+    // Uma vez por segundo, fecha os intervalos de séries que pararam de enviar amostras
+    void sweep_rollups() {
+        auto now = std::chrono::steady_clock::now();
+        if (now < next_rollup_sweep) {
+            return;
+        }
+        next_rollup_sweep = now + std::chrono::seconds(1);
+        std::time_t wall_clock = std::time(nullptr);
+        for (auto& [series_id, state] : series_states) {
+            if (!state.rollups.empty()) {
+                // Estima a hora atual no relógio do sensor, que pode estar defasado do local
+                std::time_t sensor_now = state.last_sample_timestamp + (wall_clock - state.last_sample_arrival);
+                flush_rollups(sensor_registry.machine_name(series_id), sensor_registry.sensor_name(series_id), state,
+                              sensor_now);
+            }
+        }
+    }
 
-// Função para calcular a tendência usando regressão linear simples
-double calculateTrend(const std::deque<double>& values) {
-    size_t n = values.size();
-    double sumX = 0.0, sumY = 0.0, sumXY = 0.0, sumXX = 0.0;
+    // Aloca com antecedência o estado de uma série anunciada: janela, regras,
+    // agregados, coluna da frota e histórico
+    void provision(uint32_t series_id) {
+        const SeriesInfo& info = sensor_registry.series(series_id);
+        const std::string& machine_id = sensor_registry.machines.name(info.machine);
+        const std::string& sensor_id = sensor_registry.sensors.name(info.sensor);
+        if (per_series_analytics()) {
+            get_series_state(series_id, machine_id, sensor_id);
+        }
+        if (config.history_retention.count() > 0) {
+            history_store.provision(series_id);
+        }
+        if (config.fleet_interval.count() > 0) {
+            get_fleet_column(info.sensor, sensor_id).reserve(info.machine / worker_count);
+        }
+    }
+
+    void process(const Sample& sample) {
+        if (sample.provision) {
+            provision(sample.series_id);
+            return;
+        }
+        int64_t start_ns = monotonic_ns();
+        processor_stats.queue_wait.record(start_ns - sample.enqueued_ns);
+
+        SeriesInfo& info = sensor_registry.series(sample.series_id);
+        info.last_timestamp.store(sample.timestamp, std::memory_order_relaxed);
+
+        const std::string& machine_id = sensor_registry.machines.name(info.machine);
+        const std::string& sensor_id = sensor_registry.sensors.name(info.sensor);
+        if (per_series_analytics()) {
+            SeriesState& state = get_series_state(sample.series_id, machine_id, sensor_id);
+            if (state.sensor_config->emit_raw) {
+                post_metric(machine_id, sensor_id + "." + sensor_id, sample.timestamp, sample.value);
+            }
+            clear_absence(machine_id, sensor_id, info, sample.timestamp);
+            process_sensor_data(machine_id, sensor_id, sample.timestamp, sample.value, state);
+            update_rollups(machine_id, sensor_id, sample.timestamp, sample.value, state);
+        } else {
+            // Cada amostra chega a uma só instância: o valor bruto é sempre enviado
+            post_metric(machine_id, sensor_id + "." + sensor_id, sample.timestamp, sample.value);
+        }
+        if (config.history_retention.count() > 0) {
+            history_store.append(sample.series_id, sample.timestamp, sample.value);
+        }
+        // Um timestamp absurdo (ano 2099, por exemplo) adiantaria o relógio da frota de uma vez
+        bool skewed = replaying_capture &&
+                      sample.timestamp > replay_arrival.load(std::memory_order_relaxed) + FLEET_REPLAY_MAX_SKEW_S;
+        if (config.fleet_interval.count() > 0 && !skewed) {
+            if (replaying_capture && sample.timestamp > sample_clock) {
+                sample_clock = sample.timestamp;
+                aggregate_fleet(false); // fecha o intervalo anterior antes de aplicar a amostra
+            }
+            get_fleet_column(info.sensor, sensor_id).update(info.machine / worker_count, sample.value, fleet_clock());
+        }
 
-    if (n < 2) {
-        return 0.0;
+        processor_stats.process.record(monotonic_ns() - start_ns);
+        processor_stats.samples_processed.fetch_add(1, std::memory_order_relaxed);
     }
 
-    for (size_t i = 0; i < n; ++i) {
-        sumX += i + 1;
-        sumY += values[i];
-        sumXY += (i + 1) * values[i];
-        sumXX += (i + 1) * (i + 1);
+    SeriesState& get_series_state(uint32_t series_id, const std::string& machine_id, const std::string& sensor_id) {
+        auto it = series_states.find(series_id);
+        if (it == series_states.end()) {
+            it = series_states.emplace(series_id, SeriesState(config.sensor(sensor_id),
+                                                              *sensor_registry.series(series_id).rules)).first;
+        }
+        SeriesState& state = it->second;
+        uint64_t partition_epoch = fleet_partition.epoch();
+        if (state.partition_epoch != partition_epoch) {
+            // A divisão da frota mudou: uma máquina que acaba de chegar a esta
+            // instância pode ter um estado antigo, de quando era atendida aqui
+            if (!fleet_partition.owned_before_change(machine_id)) {
+                flush_rollups(machine_id, sensor_id, state, std::numeric_limits<std::time_t>::max() - ROLLUP_GRACE_S);
+                state = SeriesState(*state.sensor_config, *state.rules);
+            }
+            state.partition_epoch = partition_epoch;
+        }
+        return state;
     }
 
-    double slope = (n * sumXY - sumX * sumY) / (n * sumXX - sumX * sumX);
+    std::unordered_map<uint32_t, SeriesState> series_states;
+    std::chrono::steady_clock::time_point next_rollup_sweep;
+    size_t worker_index;
+    size_t worker_count;
+    std::unordered_map<uint32_t, FleetColumn> fleet_columns; // Último valor de cada máquina, por tipo de sensor
+    int64_t fleet_epoch = -1;
+    std::time_t sample_clock = 0; // reprodução: maior timestamp já processado por este worker
+    std::atomic<bool> running{false};
+    std::thread worker_thread;
+};
 
-    return slope;
-}
+// Distribui as amostras entre os workers pelo id da máquina
+class ProcessingPipeline {
+public:
+    void start(size_t worker_count, size_t queue_capacity, QueueFullPolicy policy) {
+        full_policy = policy;
+        for (size_t i = 0; i < worker_count; ++i) {
+            workers.push_back(std::make_unique<ProcessingWorker>(queue_capacity, i, worker_count));
+        }
+        fleet_aggregator.start(worker_count, config.fleet_top_k, config.fleet_interval, replaying_capture);
+        for (auto& worker : workers) {
+            worker->start();
+        }
+    }
 
-// POSTAR MÉTRICA ------------------------------------------------------------------------------------------
+    // Chamado pela thread do MQTT: apenas copia a amostra para a fila do worker responsável
+    void submit(std::string_view machine_id, std::string_view sensor_id, const SensorReading& reading) {
+        uint32_t series_id = track_series(machine_id, sensor_id, reading.timestamp);
+        const SeriesInfo& info = sensor_registry.series(series_id);
+        ProcessingWorker& worker = *workers[info.machine % workers.size()];
+        auto fill = [&](Sample& sample) {
+            sample.series_id = series_id;
+            sample.timestamp = reading.timestamp;
+            sample.value = reading.value;
+            sample.enqueued_ns = monotonic_ns();
+            sample.provision = false;
+        };
+
+        std::chrono::microseconds wait(1);
+        int64_t blocked_since = 0;
+        while (!worker.queue.try_push(fill)) {
+            if (full_policy == QueueFullPolicy::DropOldest) {
+                if (worker.queue.try_pop([](Sample&) {})) {
+                    ++dropped_samples;
+                }
+            } else {
+                if (blocked_since == 0) {
+                    blocked_since = monotonic_ns();
+                }
+                std::this_thread::sleep_for(wait);
+                wait = std::min(wait * 2, std::chrono::microseconds(1000));
+            }
+        }
+        if (blocked_since != 0) {
+            processor_stats.backpressure.record(monotonic_ns() - blocked_since);
+        }
+    }
+
+    // Pede ao worker responsável pela máquina que prepare o estado da série. É só
+    // uma antecipação: com a fila cheia (ou se o pedido for descartado por
+    // drop_oldest) a thread do MQTT não espera, e a série é preparada na primeira amostra.
+    void provision(uint32_t series_id) {
+        const SeriesInfo& info = sensor_registry.series(series_id);
+        ProcessingWorker& worker = *workers[info.machine % workers.size()];
+        worker.queue.try_push([&](Sample& sample) {
+            sample.series_id = series_id;
+            sample.enqueued_ns = monotonic_ns();
+            sample.provision = true;
+        });
+    }
 
-int post_metric(const std::string& machine_id, const std::string& sensor_id, const std::string& timestamp_str, const double value) {
-    int graphite_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (graphite_socket == -1) {
-        std::cerr << "Error: Failed to create socket\n";
-        return -1; // Retorna um código de erro
+    // Amostras aguardando processamento em todos os workers
+    size_t queue_depth() const {
+        size_t depth = 0;
+        for (const auto& worker : workers) {
+            depth += worker->queue.size();
+        }
+        return depth;
     }
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(GRAPHITE_PORT);
-    if (inet_pton(AF_INET, GRAPHITE_HOST, &server_addr.sin_addr) <= 0) {
-        std::cerr << "Error: Invalid address or address not supported\n";
-        close(graphite_socket);
-        return -1; // Retorna um código de erro
+    // Espera os workers esvaziarem suas filas e os encerra
+    void stop() {
+        for (auto& worker : workers) {
+            worker->stop();
+        }
     }
 
-    if (connect(graphite_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        std::cerr << "Error: Failed to connect to Graphite\n";
-        close(graphite_socket);
-        return -1; // Retorna um código de erro
+    size_t dropped() const {
+        return dropped_samples.load(std::memory_order_relaxed);
     }
 
-    std::string graphite_topic = "machines." + machine_id + "." + sensor_id;
-    std::stringstream metric_stream;
-    metric_stream << graphite_topic << " " << value << " " << string_to_time_t(timestamp_str) << "\n";
+private:
+    std::vector<std::unique_ptr<ProcessingWorker>> workers;
+    QueueFullPolicy full_policy = QueueFullPolicy::Block;
+    std::atomic<size_t> dropped_samples{0};
+};
 
-    std::string metric_data = metric_stream.str();
-    ssize_t sent_bytes = send(graphite_socket, metric_data.c_str(), metric_data.size(), 0);
-    if (sent_bytes == -1) {
-        std::cerr << "Error: Failed to send metric data for topic: " << graphite_topic << " with value: " << value << "\n";
-        close(graphite_socket);
-        return -1; // Retorna um código de erro
-    } else {
-        //std::cout << "Metric published to Graphite successfully for topic: " << graphite_topic << " with value: " << value << "\n";
+ProcessingPipeline processing_pipeline;
+
+// Decodifica uma mensagem de /sensors/<máquina>/<sensor> (leitura única ou lote)
+// e entrega as leituras ao pipeline. `batch` é reaproveitado entre chamadas.
+void dispatch_sensor_message(std::string_view topic, std::string_view payload, std::vector<SensorReading>& batch) {
+    int64_t arrival_ns = monotonic_ns();
+    processor_stats.messages_received.fetch_add(1, std::memory_order_relaxed);
+
+    std::string_view machine_id, sensor_id;
+    std::vector<std::string> topic_parts;
+    if (!parse_sensor_topic(topic, machine_id, sensor_id)) {
+        topic_parts = split(std::string(topic), '/');
+        if (topic_parts.size() < 4) {
+            log_text(LogLevel::Error, "Error: Unexpected topic: ", topic);
+            processor_stats.decode_errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        machine_id = topic_parts[2];
+        sensor_id = topic_parts[3];
+    }
+    if (!fleet_partition.owns(machine_id)) {
+        processor_stats.messages_skipped.fetch_add(1, std::memory_order_relaxed);
+        return;
     }
 
-    close(graphite_socket);
-    return 0; // Retorna sucesso
+    if (is_batch_frame(payload)) {
+        batch.clear();
+        if (!decode_batch(payload, batch)) {
+            processor_stats.decode_errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        processor_stats.decode.record(monotonic_ns() - arrival_ns);
+        for (const SensorReading& reading : batch) {
+            processing_pipeline.submit(machine_id, sensor_id, reading);
+        }
+        return;
+    }
+
+    SensorReading reading;
+    if (!decode_sensor_reading(payload, reading) && !decode_sensor_reading_generic(std::string(payload), reading)) {
+        processor_stats.decode_errors.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    processor_stats.decode.record(monotonic_ns() - arrival_ns);
+
+    processing_pipeline.submit(machine_id, sensor_id, reading);
 }
 
-// PROCESSAMENTO DE DADOS ---------------------------------------------------------------------------------------
-std::mutex mtx;
+// Tipos de dado anunciados que o processamento aceita: todas as leituras são tratadas como double
+bool numeric_data_type(const std::string& data_type) {
+    static const std::set<std::string> numeric = {"int", "integer", "long", "float", "double", "number"};
+    return numeric.count(data_type) > 0;
+}
+
+// Trata uma mensagem de /sensor_monitors: registra cada sensor numérico anunciado
+// e pede ao worker da máquina que prepare o estado da série, de modo que a
+// primeira amostra siga o mesmo caminho das seguintes. O maior intervalo entre
+// mensagens considera o heartbeat da publicação por mudança e o atraso dos lotes.
+void handle_sensor_monitor_announcement(const std::string& payload) {
+    processor_stats.announcements_received.fetch_add(1, std::memory_order_relaxed);
+    try {
+        nlohmann::json announcement = nlohmann::json::parse(payload);
+        std::string machine_id = announcement.at("machine_id").get<std::string>();
+        if (!fleet_partition.owns(machine_id)) {
+            return;
+        }
+        int64_t batch_delay_ms = 0;
+        if (announcement.contains("batch")) {
+            batch_delay_ms = announcement["batch"].value("max_delay_ms", int64_t(0));
+        }
 
-struct MonitoredSensor {
-    std::string sensor_id;
-    std::string last_timestamp;
-    std::thread monitor_thread;
+        for (const nlohmann::json& sensor : announcement.at("sensors")) {
+            std::string sensor_id = sensor.at("sensor_id").get<std::string>();
+            std::string data_type = sensor.value("data_type", std::string("float"));
+            if (!numeric_data_type(data_type)) {
+                log_text(LogLevel::Warn, "Warning: Ignoring sensor ", machine_id, ".", sensor_id,
+                         " with data_type ", data_type);
+                continue;
+            }
+            int64_t max_gap_ms = sensor.at("data_interval").get<int64_t>();
+            if (sensor.contains("sampling")) {
+                max_gap_ms = sensor["sampling"].value("max_gap_ms", max_gap_ms);
+            }
+            if (max_gap_ms <= 0) {
+                log_text(LogLevel::Error, "Error: Invalid data_interval for sensor ", machine_id, ".", sensor_id);
+                continue;
+            }
 
-    MonitoredSensor(const std::string& id, const std::string& timestamp) : sensor_id(id), last_timestamp(timestamp) {}
-};
+            bool created;
+            uint32_t series_id = provision_series(machine_id, sensor_id,
+                                                  std::chrono::milliseconds(max_gap_ms + batch_delay_ms), created);
+            if (created) {
+                processing_pipeline.provision(series_id);
+                processor_stats.series_provisioned.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    } catch (const nlohmann::json::exception& e) {
+        log_text(LogLevel::Error, "Error: Invalid /sensor_monitors message: ", e.what());
+        processor_stats.decode_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+}
 
-std::vector<MonitoredSensor> monitored_sensors;
+// CAPTURA E REPRODUÇÃO -----------------------------------------------------------------------------------------
 
-void process_sensor_data(const std::string& machine_id, const std::string& sensor_id, const std::string& timestamp, 
-const double value, std::deque<double>& sensorData, std::deque<std::string>& sensorTimestamp) {
+// Arquivo de captura: o identificador CAPTURE_MAGIC seguido de registros
+// [CaptureRecordHeader][tópico][payload], cada um alinhado a 8 bytes. Um registro
+// truncado no fim (processo interrompido durante a escrita) é ignorado na leitura.
+#define CAPTURE_MAGIC "DPCAP001"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_BUFFER_BYTES (1024 * 1024) // Volume acumulado em memória antes de gravar
 
-    std::cout << "\n\n" << "--------------------->    Análise de dados para o sensor " << sensor_id << "   <---------------------\n";
-    std::tm time = string_to_tm(timestamp);
-    std::cout << "Data: " << std::put_time(&time, "%d/%m/%Y, Hora: %H:%M:%S") << std::endl;
-     std::cout << "ID da máquina: " << machine_id << std::endl;
+struct CaptureRecordHeader {
+    int64_t arrival_ns;    // Instante de chegada (relógio do sistema)
+    uint32_t topic_size;
+    uint32_t payload_size;
+};
 
-    // Coleta de dados do sensor
-    sensorData.push_back(value);
-    std::lock_guard<std::mutex> lock(mtx);
+size_t capture_record_size(size_t topic_size, size_t payload_size) {
+    return (sizeof(CaptureRecordHeader) + topic_size + payload_size + 7) & ~static_cast<size_t>(7);
+}
 
-    // Atualiza o last_timestamp do sensor na lista monitored_sensors
-    auto sensor_iterator = std::find_if(monitored_sensors.begin(), monitored_sensors.end(), [&](const MonitoredSensor& sensor) {
-        return sensor.sensor_id == sensor_id + machine_id;
-    });
+// Grava as mensagens recebidas do broker, sem interpretá-las
+class CaptureWriter {
+public:
+    ~CaptureWriter() {
+        close_file();
+    }
 
-    if (sensor_iterator != monitored_sensors.end()) {
-        sensor_iterator->last_timestamp = timestamp;
+    bool open(const std::string& path) {
+        capture_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (capture_fd == -1) {
+            std::cerr << "Error: Could not open capture file " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        struct stat file_stat;
+        if (fstat(capture_fd, &file_stat) == 0 && file_stat.st_size == 0) {
+            buffer.append(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+        }
+        return true;
     }
 
-    mtx.unlock();
-    // Mantenha o tamanho máximo da janela
-    if (sensorData.size() > MOVING_AVERAGE_WINDOW) {
-        sensorData.pop_front(); // Remova o valor mais antigo se exceder o tamanho da janela
+    bool is_open() const {
+        return capture_fd != -1;
     }
 
-    // Calcular a média móvel do sensor
-    if (sensorData.size() > 0) {
-        double movingAverage = 0.0;
-        for (const auto& data : sensorData) {
-            movingAverage += data;
+    void append(std::string_view topic, std::string_view payload) {
+        CaptureRecordHeader header;
+        header.arrival_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        header.topic_size = static_cast<uint32_t>(topic.size());
+        header.payload_size = static_cast<uint32_t>(payload.size());
+        size_t padding = capture_record_size(topic.size(), payload.size()) - sizeof(header) - topic.size() - payload.size();
+
+        std::lock_guard<std::mutex> lock(capture_mtx);
+        buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        buffer.append(topic);
+        buffer.append(payload);
+        buffer.append(padding, '\0');
+        if (buffer.size() >= CAPTURE_BUFFER_BYTES) {
+            write_buffer();
         }
-        movingAverage /= sensorData.size();
+    }
 
-        std::cout << "Média móvel do uso de " << sensor_id << ": " << movingAverage << std::endl;
-        post_metric(machine_id, sensor_id + "." + sensor_id + "_moving_average", timestamp, movingAverage);
+    // Chamado periodicamente para que a captura não fique muito atrás do tráfego
+    void flush() {
+        std::lock_guard<std::mutex> lock(capture_mtx);
+        write_buffer();
+    }
 
-        // Detectar outliers usando Z-score
-        double zScore = calculateZScore(value, sensorData);
-        double zScoreThreshold = 1.0; // Defina o limite de Z-score para considerar um ponto como outlier
+    void close_file() {
+        if (capture_fd != -1) {
+            flush();
+            close(capture_fd);
+            capture_fd = -1;
+        }
+    }
 
-        if (std::abs(zScore) > zScoreThreshold) {
-            // Se o valor atual for um outlier
-            std::cout << RED << "[ALARME]" << RESET << " Outlier detectado: " << value << std::endl;
-            post_metric(machine_id, "alarms." + sensor_id + "_outlier", timestamp, 1);
-        } else {
-            // Se não for um outlier
-            std::cout << "Uso normal de " << sensor_id << ": " << value << std::endl;
+private:
+    void write_buffer() {
+        size_t written = 0;
+        while (written < buffer.size()) {
+            ssize_t result = write(capture_fd, buffer.data() + written, buffer.size() - written);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                log_text(LogLevel::Error, "Error: Could not write capture file: ", std::strerror(errno));
+                break;
+            }
+            written += static_cast<size_t>(result);
         }
-        // Calcular a tendência dos valores
-        double trend = calculateTrend(sensorData);
-        std::cout << "Tendência do uso de " << sensor_id << ": " << trend << std::endl;
-        post_metric(machine_id, sensor_id + "." + sensor_id + "_trend", timestamp, trend);
-        std::cout << "----------------------------------------------------------------------------------------------\n";
+        buffer.clear();
     }
-}
 
-void process_sensor_alarm(const std::string& machine_id, const std::string& sensor_id, const std::string& sensor_name) {
-    const int expected_interval_seconds = 30; // intervalo de chegada esperado
-    const int max_expected_delay = expected_interval_seconds; // máximo de atraso esperado para gerar um alarme
+    int capture_fd = -1;
+    std::string buffer;
+    std::mutex capture_mtx;
+};
 
-    std::lock_guard<std::mutex> lock(mtx);
+CaptureWriter capture_writer;
 
-    auto sensor_iterator = std::find_if(monitored_sensors.begin(), monitored_sensors.end(), [&](const MonitoredSensor& sensor) {
-        return sensor.sensor_id == sensor_id;
-    });
+// Reproduz um arquivo de captura pelo mesmo pipeline das mensagens ao vivo. Com
+// speed == 0 as mensagens são entregues o mais rápido possível; caso contrário os
+// intervalos originais entre chegadas são divididos por speed.
+bool replay_capture(const std::string& path, double speed, size_t& replayed) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        std::cerr << "Error: Could not open capture file " << path << ": " << std::strerror(errno) << std::endl;
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = static_cast<size_t>(file_stat.st_size);
+    if (size < CAPTURE_MAGIC_SIZE) {
+        std::cerr << "Error: " << path << " is not a capture file" << std::endl;
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Error: Could not map capture file " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    const char* data = static_cast<const char*>(mapping);
+    if (std::memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+        std::cerr << "Error: " << path << " is not a capture file" << std::endl;
+        munmap(mapping, size);
+        return false;
+    }
+
+    std::vector<SensorReading> batch;
+    auto replay_start = std::chrono::steady_clock::now();
+    int64_t first_arrival_ns = 0;
+    size_t offset = CAPTURE_MAGIC_SIZE;
+    replayed = 0;
 
-    if (sensor_iterator != monitored_sensors.end()) {
-        std::string last_timestamp = sensor_iterator->last_timestamp;
-        std::time_t last_time = string_to_time_t(last_timestamp);
-        std::time_t current_time = std::time(nullptr);
-        int seconds_since_last_timestamp = current_time - last_time;
-        auto now = std::chrono::system_clock::now();
-        std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-        std::tm* now_tm = std::gmtime(&now_c);
-        std::stringstream ss;
-        ss << std::put_time(now_tm, "%FT%TZ");
-        std::string timestamp = ss.str();
+    while (offset + sizeof(CaptureRecordHeader) <= size) {
+        CaptureRecordHeader header;
+        std::memcpy(&header, data + offset, sizeof(header));
+        size_t record_size = capture_record_size(header.topic_size, header.payload_size);
+        if (record_size > size - offset) {
+            std::cerr << "Warning: Capture file ends with a truncated record" << std::endl;
+            break;
+        }
 
-        if (seconds_since_last_timestamp > max_expected_delay) {
-            // Gerar alarme se o atraso for maior do que o esperado
-            std::cout << RED << "\n⚠️ - [ALARME] " << RESET << "Dados do sensor " << sensor_name << " da máquina " << machine_id << " não foram recebidos por mais de 10 períodos de tempo previstos." << std::endl;
-            post_metric(machine_id, "alarms.inactive_" + sensor_name, timestamp, 1);
+        if (speed > 0) {
+            if (replayed == 0) {
+                first_arrival_ns = header.arrival_ns;
+            }
+            auto due = replay_start + std::chrono::nanoseconds(
+                static_cast<int64_t>((header.arrival_ns - first_arrival_ns) / speed));
+            std::this_thread::sleep_until(due);
         }
+
+        const char* topic = data + offset + sizeof(header);
+        replay_arrival.store(static_cast<std::time_t>(header.arrival_ns / 1000000000), std::memory_order_relaxed);
+        dispatch_sensor_message(std::string_view(topic, header.topic_size),
+                                std::string_view(topic + header.topic_size, header.payload_size), batch);
+        ++replayed;
+        offset += record_size;
     }
-    mtx.unlock();
-}
 
-std::deque<std::string> cpuUsageTimestamps;
-void process_sensor_data_cpu(const std::string& machine_id, const std::string& sensor_id, const std::string& timestamp, const double value) {
-    static std::deque<double> cpuUsageData; // Use uma deque para armazenar valores anteriores
-    process_sensor_data(machine_id, sensor_id, timestamp, value, cpuUsageData, cpuUsageTimestamps);
+    munmap(mapping, size);
+    return true;
 }
 
-std::deque<std::string> memUsageTimestamps;
-void process_sensor_data_mem(const std::string& machine_id, const std::string& sensor_id, const std::string& timestamp, const double value) {
-    static std::deque<double> memUsageData; // Use uma deque para armazenar valores anteriores
-    process_sensor_data(machine_id, sensor_id, timestamp, value, memUsageData, memUsageTimestamps);
+// AUTOMONITORAMENTO -------------------------------------------------------------------------------------------
+
+#define STATS_MACHINE_ID "data_processor" // As métricas próprias vão para machines.data_processor.*
+#define STATS_REQUEST_MAX_BYTES 4096
+#define STATS_SOCKET_TIMEOUT_MS 1000
+
+using StatsList = std::vector<std::pair<std::string, double>>;
+
+struct StageHistogram {
+    const char* name;
+    const LatencyHistogram* histogram;
+};
+
+const std::array<StageHistogram, 6> stage_histograms = {{
+    {"decode", &processor_stats.decode},
+    {"queue_wait", &processor_stats.queue_wait},
+    {"process", &processor_stats.process},
+    {"graphite_flush", &processor_stats.graphite_flush},
+    {"lock_wait", &processor_stats.lock_wait},
+    {"backpressure", &processor_stats.backpressure},
+}};
+
+void collect_counters_and_gauges(StatsList& stats) {
+    stats.emplace_back("counters.messages_received", processor_stats.messages_received.load());
+    stats.emplace_back("counters.decode_errors", processor_stats.decode_errors.load());
+    stats.emplace_back("counters.messages_skipped", processor_stats.messages_skipped.load());
+    stats.emplace_back("counters.announcements_received", processor_stats.announcements_received.load());
+    stats.emplace_back("counters.series_provisioned", processor_stats.series_provisioned.load());
+    stats.emplace_back("counters.samples_processed", processor_stats.samples_processed.load());
+    stats.emplace_back("counters.samples_dropped", processing_pipeline.dropped());
+    stats.emplace_back("counters.metrics_posted", processor_stats.metrics_posted.load());
+    stats.emplace_back("counters.graphite_lines_sent", processor_stats.graphite_lines_sent.load());
+    stats.emplace_back("counters.graphite_lines_spilled", processor_stats.graphite_lines_spilled.load());
+    stats.emplace_back("counters.statsd_lines_sent", processor_stats.statsd_lines_sent.load());
+    stats.emplace_back("counters.statsd_send_errors", processor_stats.statsd_send_errors.load());
+    stats.emplace_back("counters.statsd_paths_rejected", processor_stats.statsd_paths_rejected.load());
+
+    stats.emplace_back("gauges.queue_depth", processing_pipeline.queue_depth());
+    stats.emplace_back("gauges.active_series", sensor_registry.size());
+    stats.emplace_back("gauges.graphite_backlog", metric_sinks_backlog());
+    stats.emplace_back("gauges.spill_backlog_bytes", graphite_spill_log.backlog_bytes());
+    stats.emplace_back("gauges.history_points", history_store.size());
+    stats.emplace_back("gauges.history_bytes", history_store.bytes());
 }
 
-std::vector<std::string> split(const std::string &str, char delim) {
-    std::vector<std::string> tokens;
-    std::string token;
-    std::istringstream tokenStream(str);
-    while (std::getline(tokenStream, token, delim)) {
-        tokens.push_back(token);
+void collect_stage_latencies(StatsList& stats, const char* stage, const LatencyHistogram::Snapshot& snapshot) {
+    std::string prefix = std::string("stages.") + stage + ".";
+    stats.emplace_back(prefix + "count", snapshot.total);
+    if (snapshot.total == 0) {
+        return;
     }
-    return tokens;
+    stats.emplace_back(prefix + "p50_us", snapshot.percentile(0.50) / 1000.0);
+    stats.emplace_back(prefix + "p90_us", snapshot.percentile(0.90) / 1000.0);
+    stats.emplace_back(prefix + "p99_us", snapshot.percentile(0.99) / 1000.0);
+    stats.emplace_back(prefix + "max_us", snapshot.max() / 1000.0);
 }
 
-void check_sensor_inactivity(const std::string& machine_id, const std::string& sensor_id,
-    const std::string& sensor_name) {
-    // Função para verificar a inatividade do sensor
-    while (true) {
+// Publica periodicamente as métricas do próprio data_processor no Graphite. As
+// latências de cada envio se referem apenas ao último intervalo.
+class StatsReporter {
+public:
+    ~StatsReporter() {
+        stop();
+    }
+
+    void start(std::chrono::seconds report_interval) {
+        interval = report_interval;
+        running = true;
+        reporter_thread = std::thread(&StatsReporter::run, this);
+    }
+
+    void stop() {
         {
-            process_sensor_alarm(machine_id, sensor_id, sensor_name);
+            std::lock_guard<std::mutex> lock(reporter_mtx);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        reporter_cv.notify_one();
+        if (reporter_thread.joinable()) {
+            reporter_thread.join();
         }
-        std::this_thread::sleep_for(std::chrono::seconds(20));
     }
-}
 
-void add_monitored_sensor(const std::string& sensor_id, const std::string& timestamp) {
-    std::lock_guard<std::mutex> lock(mtx);
-    monitored_sensors.emplace_back(sensor_id, timestamp);
-    mtx.unlock();
-}
+private:
+    void run() {
+        std::array<LatencyHistogram::Snapshot, stage_histograms.size()> previous;
+        StatsList stats;
+        // Com a frota dividida, cada instância publica em machines.data_processor_<instância>.*
+        const std::string machine_id =
+            instance_metric_id.empty() ? STATS_MACHINE_ID : STATS_MACHINE_ID "_" + instance_metric_id;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(reporter_mtx);
+                if (reporter_cv.wait_for(lock, interval, [this] { return !running; })) {
+                    return;
+                }
+            }
+
+            stats.clear();
+            collect_counters_and_gauges(stats);
+            for (size_t i = 0; i < stage_histograms.size(); ++i) {
+                LatencyHistogram::Snapshot current = stage_histograms[i].histogram->snapshot();
+                collect_stage_latencies(stats, stage_histograms[i].name, current.since(previous[i]));
+                previous[i] = current;
+            }
+
+            std::time_t now = std::time(nullptr);
+            for (const auto& [name, value] : stats) {
+                post_metric(machine_id, name, now, value);
+            }
+        }
+    }
+
+    std::chrono::seconds interval{0};
+    std::mutex reporter_mtx;
+    std::condition_variable reporter_cv;
+    bool running = false;
+    std::thread reporter_thread;
+};
+
+// Socket Unix local para consultas ao data_processor. O cliente envia uma linha
+// com o comando (padrão "stats") e recebe a resposta em texto até o fechamento da
+// conexão, por exemplo: echo stats | nc -U /var/tmp/data_processor.sock
+class StatsServer {
+public:
+    using Handler = std::function<std::string(const std::string& arguments)>;
+
+    ~StatsServer() {
+        stop();
+    }
+
+    void add_command(const std::string& name, Handler handler) {
+        commands[name] = std::move(handler);
+    }
+
+    bool start(const std::string& socket_path) {
+        struct sockaddr_un address = {};
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "Error: Stats socket path too long: " << socket_path << std::endl;
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+        // Só remove o socket que sobrou de uma execução anterior: se alguém ainda
+        // atende nele, é outra instância, e ela fica com o caminho
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe != -1) {
+            bool in_use = connect(probe, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0;
+            int probe_error = errno;
+            close(probe);
+            if (in_use) {
+                std::cerr << "Error: Stats socket " << socket_path << " is in use by another process" << std::endl;
+                return false;
+            }
+            if (probe_error == ECONNREFUSED) {
+                unlink(socket_path.c_str());
+            }
+        }
+
+        listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_socket == -1 || bind(listen_socket, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1 ||
+            listen(listen_socket, 8) == -1) {
+            std::cerr << "Error: Could not listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+            if (listen_socket != -1) {
+                close(listen_socket);
+                listen_socket = -1;
+            }
+            return false;
+        }
+        path = socket_path;
+        running = true;
+        server_thread = std::thread(&StatsServer::run, this);
+        return true;
+    }
+
+    void stop() {
+        if (!running.exchange(false)) {
+            return;
+        }
+        if (server_thread.joinable()) {
+            server_thread.join();
+        }
+        close(listen_socket);
+        listen_socket = -1;
+        unlink(path.c_str());
+    }
+
+private:
+    void run() {
+        while (running.load(std::memory_order_relaxed)) {
+            struct pollfd listen_poll = {listen_socket, POLLIN, 0};
+            if (poll(&listen_poll, 1, STATS_SOCKET_TIMEOUT_MS) <= 0) {
+                continue;
+            }
+            int client = accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client == -1) {
+                continue;
+            }
+            serve(client);
+            close(client);
+        }
+    }
+
+    void serve(int client) {
+        struct timeval timeout = {STATS_SOCKET_TIMEOUT_MS / 1000, (STATS_SOCKET_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // Lê uma linha; uma conexão sem pedido (ou que só fecha a escrita) recebe "stats"
+        std::string request;
+        char buffer[512];
+        while (request.find('\n') == std::string::npos && request.size() < STATS_REQUEST_MAX_BYTES) {
+            ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                break;
+            }
+            request.append(buffer, static_cast<size_t>(received));
+        }
+        request = request.substr(0, request.find('\n'));
+        while (!request.empty() && (request.back() == '\r' || request.back() == ' ')) {
+            request.pop_back();
+        }
+
+        size_t space = request.find(' ');
+        std::string name = request.substr(0, space);
+        std::string arguments = space == std::string::npos ? "" : request.substr(space + 1);
+        if (name.empty()) {
+            name = "stats";
+        }
+
+        std::string response;
+        auto command = commands.find(name);
+        if (command == commands.end()) {
+            response = "error: unknown command \"" + name + "\"\n";
+        } else {
+            response = command->second(arguments);
+        }
+        size_t written = 0;
+        while (written < response.size()) {
+            ssize_t result = send(client, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+            if (result <= 0) {
+                break;
+            }
+            written += static_cast<size_t>(result);
+        }
+    }
+
+    std::unordered_map<std::string, Handler> commands;
+    std::string path;
+    int listen_socket = -1;
+    std::atomic<bool> running{false};
+    std::thread server_thread;
+};
 
-bool is_sensor_monitored(const std::string& sensor_id) {
-    std::lock_guard<std::mutex> lock(mtx);
-    return std::find_if(monitored_sensors.begin(), monitored_sensors.end(), [&](const MonitoredSensor& sensor) {
-        mtx.unlock();
-        return sensor.sensor_id == sensor_id;
-    }) != monitored_sensors.end();
+// Resposta do comando "stats": valores acumulados desde o início do processo
+std::string render_stats(const std::string&) {
+    StatsList stats;
+    collect_counters_and_gauges(stats);
+    for (const StageHistogram& stage : stage_histograms) {
+        collect_stage_latencies(stats, stage.name, stage.histogram->snapshot());
+    }
+    std::ostringstream response;
+    for (const auto& [name, value] : stats) {
+        response << name << " " << value << "\n";
+    }
+    return response.str();
 }
 
-void process_message(const std::string& machine_id, const std::string& sensor_id, const std::string& timestamp,
-    const std::string& sensor_name) {
-    if (!is_sensor_monitored(sensor_id)) {
-        std::thread sensor_thread(check_sensor_inactivity, machine_id, sensor_id, sensor_name);
-        sensor_thread.detach();
-        add_monitored_sensor(sensor_id, timestamp);
+// Comando "log_level [nível]": consulta ou altera o nível de log em execução
+std::string handle_log_level(const std::string& arguments) {
+    if (!arguments.empty()) {
+        LogLevel level;
+        if (!parse_log_level(arguments, level)) {
+            return "error: log level must be debug, info, warn, error or off\n";
+        }
+        logger.set_level(level);
     }
+    return std::string(log_level_name(logger.level())) + "\n";
 }
 
+StatsReporter stats_reporter;
+StatsServer stats_server;
+
 // MAIN ---------------------------------------------------------------------------------------------------------
 
+#ifndef DATA_PROCESSOR_NO_MAIN // Definido pelos benchmarks, que incluem este arquivo
 int main(int argc, char* argv[]) {
-    std::string clientId = "clientId";
-    mqtt::async_client client(BROKER_ADDRESS, clientId);
+    std::string config_path, capture_path, replay_path;
+    double replay_speed = 0.0; // 0 = o mais rápido possível
+    bool valid_arguments = true;
+    for (int i = 1; i < argc && valid_arguments; ++i) {
+        std::string argument = argv[i];
+        if ((argument == "--capture" || argument == "--replay" || argument == "--speed") && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (argument == "--capture") {
+                capture_path = value;
+            } else if (argument == "--replay") {
+                replay_path = value;
+            } else {
+                replay_speed = std::atof(value.c_str());
+            }
+        } else if (config_path.empty() && argument.rfind("--", 0) != 0) {
+            config_path = argument;
+        } else {
+            valid_arguments = false;
+        }
+    }
+    if (!valid_arguments || (!replay_path.empty() && !capture_path.empty())) {
+        std::cout << "Uso: " << argv[0] << " [arquivo_de_configuracao.json] [--capture arquivo]\n"
+                  << "       " << argv[0] << " [arquivo_de_configuracao.json] --replay arquivo [--speed fator]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!config_path.empty()) {
+        try {
+            load_config(config_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Invalid configuration: " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    logger.set_level(config.log_level);
+    logger.start(config.log_repeat_interval);
+
+    // Cada instância precisa de um client ID próprio: o broker desconecta a anterior ao receber um repetido
+    std::string clientId = config.mqtt_client_id;
+    if (clientId.empty()) {
+        char hostname[256] = "localhost";
+        gethostname(hostname, sizeof(hostname) - 1);
+        clientId = "data-processor-" + std::string(hostname) + "-" + std::to_string(getpid());
+    }
+    if (config.partitioning != Partitioning::None) {
+        instance_metric_id = metric_path_safe(clientId);
+    }
+    if (config.partitioning == Partitioning::Hash) {
+        fleet_partition.start(clientId);
+    }
+    mqtt::async_client client(config.mqtt_broker, clientId);
 
     // Create an MQTT callback.
     class callback : public virtual mqtt::callback {
     public:
 
         void message_arrived(mqtt::const_message_ptr msg) override {
-            auto j = nlohmann::json::parse(msg->get_payload());
+            const std::string& topic = msg->get_topic();
+            const std::string& payload = msg->get_payload_ref();
 
-            std::string topic = msg->get_topic();
-            auto topic_parts = split(topic, '/');
-            std::string machine_id = topic_parts[2];
-            std::string sensor_id = topic_parts[3];
+            // Anúncio de uma instância; o anúncio vazio (testamento) indica que ela saiu
+            if (topic.rfind(PRESENCE_TOPIC_PREFIX, 0) == 0) {
+                fleet_partition.update_member(topic.substr(std::strlen(PRESENCE_TOPIC_PREFIX)), !payload.empty());
+                return;
+            }
 
-            std::string timestamp = j["timestamp"];
-            double value = j["value"];
+            if (topic == SENSOR_MONITORS_TOPIC) {
+                handle_sensor_monitor_announcement(payload);
+                return;
+            }
 
-            post_metric(machine_id, sensor_id + "." + sensor_id, timestamp, value);
-            if (sensor_id == "cpu_usage") {
-                process_sensor_data_cpu(machine_id, sensor_id, timestamp, value);
-                std::string process_id = sensor_id + machine_id;
-                process_message(machine_id, process_id, timestamp, sensor_id);
-            } else {
-                 process_sensor_data_mem(machine_id, sensor_id, timestamp, value);
-                 std::string process_id = sensor_id + machine_id;
-                 process_message(machine_id, process_id, timestamp, sensor_id);
+            if (capture_writer.is_open()) {
+                capture_writer.append(topic, payload);
             }
+            dispatch_sensor_message(topic, payload, batch);
         }
+
+    private:
+        std::vector<SensorReading> batch; // Reaproveitado entre mensagens em lote
     };
 
+    SpillLog* spill_log = nullptr;
+    if (!config.spill_directory.empty()) {
+        if (graphite_spill_log.open(config.spill_directory, config.spill_segment_mb * 1024 * 1024,
+                                    config.spill_max_mb / config.spill_segment_mb)) {
+            spill_log = &graphite_spill_log;
+            graphite_spill_replayer.start(config.graphite_host, config.graphite_port, graphite_spill_log,
+                                          config.spill_replay_rate);
+        } else if (graphite_spill_log.in_use()) {
+            return EXIT_FAILURE; // Cada instância precisa do seu graphite.spill.directory
+        } else {
+            std::cerr << "Warning: Graphite spill log disabled" << std::endl;
+        }
+    }
+    start_metric_sinks(spill_log, !replay_path.empty());
+
+    if (config.stats_interval.count() > 0) {
+        stats_reporter.start(config.stats_interval);
+    }
+    if (!config.stats_socket.empty()) {
+        stats_server.add_command("stats", render_stats);
+        stats_server.add_command("log_level", handle_log_level);
+        stats_server.add_command("history", handle_history);
+        stats_server.add_command("partition", [](const std::string&) {
+            return fleet_partition.describe();
+        });
+        stats_server.add_command("fleet", [](const std::string&) {
+            return fleet_aggregator.last_report();
+        });
+        if (!stats_server.start(config.stats_socket)) {
+            std::cerr << "Warning: Stats socket disabled" << std::endl;
+        }
+    }
+
+    size_t workers = config.workers;
+    if (workers == 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Reprodução de uma captura: sem broker, sem descarte de amostras e sem alarmes
+    // de inatividade (os timestamps reproduzidos são antigos)
+    if (!replay_path.empty()) {
+        replaying_capture = true;
+        processing_pipeline.start(workers, config.queue_capacity, QueueFullPolicy::Block);
+        auto replay_start = std::chrono::steady_clock::now();
+        size_t replayed = 0;
+        bool replay_ok = replay_capture(replay_path, replay_speed, replayed);
+        processing_pipeline.stop();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+        stats_server.stop();
+        stats_reporter.stop();
+        stop_metric_sinks();
+        graphite_spill_replayer.stop();
+        logger.stop();
+
+        std::cout << "Replayed " << replayed << " messages in " << seconds << " s ("
+                  << (seconds > 0 ? replayed / seconds : 0.0) << " msgs/s)" << std::endl;
+        return replay_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (!capture_path.empty() && !capture_writer.open(capture_path)) {
+        return EXIT_FAILURE;
+    }
+    inactivity_scheduler.start();
+    processing_pipeline.start(workers, config.queue_capacity, config.queue_full_policy);
+
     callback cb;
     client.set_callback(cb);
     // Connect to the MQTT broker.
     mqtt::connect_options connOpts;
     connOpts.set_keep_alive_interval(20);
     connOpts.set_clean_session(true);
+    std::string presence_topic = PRESENCE_TOPIC_PREFIX + clientId;
+    if (config.partitioning == Partitioning::Hash) {
+        // Se a instância cair, o broker apaga o seu anúncio retido e as outras redividem a frota
+        connOpts.set_will(mqtt::will_options(presence_topic, std::string(), QOS, true));
+    }
 
     try {
         client.connect(connOpts)->wait();
-        client.subscribe("/sensors/#", QOS);
-        std::cout << "Subscrided\n";
+        if (config.partitioning == Partitioning::Hash) {
+            client.subscribe(PRESENCE_TOPIC_PREFIX "+", QOS)->wait();
+            std::string announcement = "{\"client_id\":\"" + clientId + "\",\"started\":" +
+                                       std::to_string(std::time(nullptr)) + "}";
+            client.publish(mqtt::make_message(presence_topic, announcement, QOS, true))->wait();
+        }
+        // No modo compartilhado o broker entrega cada mensagem a uma só instância do grupo
+        std::string sensors_filter = config.partitioning == Partitioning::Shared
+            ? "$share/" + config.share_group + "//sensors/#" : "/sensors/#";
+        client.subscribe(sensors_filter, QOS);
+        if (config.announcements) {
+            // Os anúncios vão para todas as instâncias; cada uma prepara só as máquinas que atende
+            client.subscribe(SENSOR_MONITORS_TOPIC, QOS);
+        }
+        std::cout << "Subscrided as " << clientId << "\n";
     } catch (mqtt::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return EXIT_FAILURE;
@@ -356,7 +5249,11 @@ int main(int argc, char* argv[]) {
 
     while (true) {
         std::this_thread::sleep_for(std::chrono::seconds(1));
+        if (capture_writer.is_open()) {
+            capture_writer.flush();
+        }
     }
 
     return EXIT_SUCCESS;
 }
+#endif
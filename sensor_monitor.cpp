@@ -5,77 +5,760 @@
 #include <thread>
 #include <unistd.h>
 #include "json.hpp" // json handling
-#include "mqtt/client.h" // paho mqtt
+#include "mqtt/async_client.h" // paho mqtt
 #include <iomanip>
-#include <sys/sysinfo.h> // Para obter informações de memória
-#include <unistd.h>
+#include <fcntl.h> // Para manter os arquivos do /proc abertos
+#include <sys/mman.h> // Buffer de mensagens mapeado em memória
 #include <fstream>
 #include <sstream>
 #include <random>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cerrno>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <string_view>
+#include <cmath>
+#include <algorithm>
 
 #define QOS 1
 #define BROKER_ADDRESS "tcp://localhost:1883"
-#define MESSAGE_INTERVAL 10 // Intervalo inicial da mensagem (em segundos)
+#define MESSAGE_INTERVAL 10 // Intervalo de reenvio da mensagem inicial (em segundos)
+#define DEFAULT_DATA_INTERVAL 5000 // Intervalo padrão de leitura de cada sensor (em milissegundos)
+#define DEFAULT_HEARTBEAT_INTERVALS 5 // Com deadband, publica ao menos a cada 5 intervalos (25 s < 30 s de inatividade)
+#define ADAPTIVE_SLOWDOWN 1.5 // Fator de aumento do intervalo a cada leitura estável
+
+// Publicação orientada a mudanças (opcional). Uma leitura só é publicada se
+// diferir da última publicada em mais que deadband (absoluto) ou deadband_pct
+// (% do último valor), ou se a última publicação tiver sido há heartbeat_intervals
+// intervalos. Com min_interval < max_interval a amostragem é adaptativa: uma
+// mudança acima do deadband volta ao intervalo mínimo e cada leitura estável o
+// aumenta até o máximo.
+struct SamplingPolicy {
+    double deadband = 0.0;
+    double deadband_pct = 0.0;
+    int heartbeat_intervals = DEFAULT_HEARTBEAT_INTERVALS;
+    int min_interval = 0; // ms
+    int max_interval = 0; // ms
+
+    bool deadband_enabled() const { return deadband > 0.0 || deadband_pct > 0.0; }
+    bool adaptive() const { return min_interval < max_interval; }
+
+    // Se a mudança em relação ao último valor publicado é significativa
+    bool changed(double value, double last_published) const {
+        double delta = std::abs(value - last_published);
+        return delta > deadband && delta > deadband_pct / 100.0 * std::abs(last_published);
+    }
+};
 
 // Definição da estrutura de dados para um sensor
 struct SensorInfo {
     std::string sensor_id;
     std::string data_type;
     int data_interval;
+    SamplingPolicy sampling;
+
+    // Maior intervalo possível entre duas publicações, anunciado ao data_processor
+    int max_gap() const {
+        if (!sampling.deadband_enabled()) {
+            return sampling.max_interval;
+        }
+        return std::max(sampling.heartbeat_intervals * data_interval, sampling.max_interval);
+    }
+};
+
+// Modo de envio em lote (opcional): até max_samples leituras, ou o que houver
+// após max_delay_ms, vão numa única mensagem no formato indicado
+struct BatchConfig {
+    std::string format; // "json" ou "cbor"; vazio desativa o modo em lote
+    size_t max_samples = 1;
+    std::chrono::milliseconds max_delay{0};
+
+    bool enabled() const { return !format.empty(); }
 };
 
-// Função para obter a porcentagem de CPU utilizada
-float getCPUUsage() {
-    std::ifstream fileStat("/proc/stat");
-    if (!fileStat.is_open()) {
-        std::cerr << "Erro ao abrir /proc/stat\n";
-        return -1;
+// Com "log_level" em "warn" ou "error", as mensagens publicadas não são registradas
+bool log_published_messages = true;
+
+// LEITURA DOS SENSORES ------------------------------------------------------------------------------------------
+
+// Arquivo do /proc ou /sys mantido aberto durante toda a execução. Cada leitura
+// relê o conteúdo desde o início com pread para o mesmo buffer, sem reabrir o
+// arquivo; o buffer só cresce se o arquivo não couber nele.
+class ProcFile {
+public:
+    ProcFile(const std::string& path, size_t buffer_size) : path(path), buffer(buffer_size) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
     }
 
-    std::string line;
-    std::getline(fileStat, line);
-    std::istringstream ss(line);
+    ~ProcFile() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
 
-    // Ler a primeira linha que contém informações sobre a CPU
-    std::string cpuLabel;
-    ss >> cpuLabel;
+    ProcFile(const ProcFile&) = delete;
+    ProcFile& operator=(const ProcFile&) = delete;
 
-    // Ler os valores referentes ao uso da CPU
-    int user, nice, system, idle;
-    ss >> user >> nice >> system >> idle;
+    bool is_open() const { return fd != -1; }
 
-    // Calcular o total do tempo de CPU
-    int totalCpuTime = user + nice + system + idle;
+    // Conteúdo atual do arquivo; vazio em caso de erro. Se a leitura encher o
+    // buffer (ex.: /proc/net/dev com muitas interfaces), ele dobra e o arquivo é relido.
+    std::string_view read() {
+        while (true) {
+            ssize_t n = pread(fd, buffer.data(), buffer.size(), 0);
+            if (n < 0) {
+                std::cerr << "Erro ao ler " << path << "\n";
+                return {};
+            }
+            if (static_cast<size_t>(n) < buffer.size()) {
+                return std::string_view(buffer.data(), static_cast<size_t>(n));
+            }
+            buffer.resize(buffer.size() * 2);
+        }
+    }
 
-    // Calcular o tempo da CPU utilizada (exceto idle)
-    int cpuUsed = totalCpuTime - idle;
+private:
+    std::string path;
+    std::vector<char> buffer;
+    int fd = -1;
+};
 
-    // Calcular a porcentagem de uso da CPU
-    float cpuUsage = ((float)cpuUsed / totalCpuTime) * 100;
+// Lê o próximo inteiro sem sinal de `text` a partir de `pos`, pulando o que não for dígito
+bool next_uint(std::string_view text, size_t& pos, uint64_t& value) {
+    while (pos < text.size() && (text[pos] < '0' || text[pos] > '9')) {
+        if (text[pos] == '\n') {
+            return false; // não atravessa linhas
+        }
+        ++pos;
+    }
+    auto result = std::from_chars(text.data() + pos, text.data() + text.size(), value);
+    if (result.ec != std::errc()) {
+        return false;
+    }
+    pos = static_cast<size_t>(result.ptr - text.data());
+    return true;
+}
 
-    return cpuUsage;
+// Posição logo após `key` no início de uma linha, ou npos
+size_t find_line(std::string_view text, std::string_view key) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        if (text.compare(pos, key.size(), key) == 0) {
+            return pos + key.size();
+        }
+        pos = text.find('\n', pos);
+        if (pos == std::string_view::npos) {
+            break;
+        }
+        ++pos;
+    }
+    return std::string_view::npos;
 }
 
-// Função para obter a porcentagem de memória utilizada
-float getMemoryUsage() {
-    struct sysinfo memInfo;
-    if (sysinfo(&memInfo) != -1) {
-        long long totalVirtualMem = memInfo.totalram;
-        totalVirtualMem += memInfo.totalswap;
-        totalVirtualMem *= memInfo.mem_unit;
+class SensorReader {
+public:
+    virtual ~SensorReader() {}
+    // Produz uma nova leitura; retorna false se o valor não pôde ser obtido
+    virtual bool read(double& value) = 0;
+};
+
+// Porcentagem de CPU utilizada desde a leitura anterior (/proc/stat)
+class CpuUsageReader : public SensorReader {
+public:
+    CpuUsageReader() : stat("/proc/stat", 4096) {
+        if (stat.is_open()) {
+            sample(last_busy, last_total); // a primeira leitura já mede apenas o intervalo
+        }
+    }
+
+    bool read(double& value) override {
+        uint64_t busy, total;
+        if (!sample(busy, total)) {
+            return false;
+        }
+        uint64_t delta_total = total - last_total;
+        value = delta_total == 0 ? 0.0 : 100.0 * static_cast<double>(busy - last_busy) / static_cast<double>(delta_total);
+        last_busy = busy;
+        last_total = total;
+        return true;
+    }
+
+    bool is_open() const { return stat.is_open(); }
+
+private:
+    // Soma os tempos da linha "cpu" (user nice system idle iowait irq softirq steal)
+    bool sample(uint64_t& busy, uint64_t& total) {
+        std::string_view text = stat.read();
+        size_t pos = find_line(text, "cpu ");
+        if (pos == std::string_view::npos) {
+            return false;
+        }
+        uint64_t fields[8] = {};
+        for (int i = 0; i < 8; ++i) {
+            if (!next_uint(text, pos, fields[i])) {
+                if (i < 4) {
+                    return false;
+                }
+                break; // kernels antigos não têm todas as colunas
+            }
+        }
+        uint64_t idle = fields[3] + fields[4]; // idle + iowait
+        total = 0;
+        for (uint64_t field : fields) {
+            total += field;
+        }
+        busy = total - idle;
+        return true;
+    }
+
+    ProcFile stat;
+    uint64_t last_busy = 0, last_total = 0;
+};
+
+// Porcentagem de memória (RAM + swap) em uso, desconsiderando caches recuperáveis (/proc/meminfo)
+class MemoryUsageReader : public SensorReader {
+public:
+    MemoryUsageReader() : meminfo("/proc/meminfo", 8192) {}
+
+    bool read(double& value) override {
+        std::string_view text = meminfo.read();
+        uint64_t mem_total, mem_available, swap_total = 0, swap_free = 0;
+        if (!field(text, "MemTotal:", mem_total) || !field(text, "MemAvailable:", mem_available) || mem_total == 0) {
+            return false;
+        }
+        field(text, "SwapTotal:", swap_total);
+        field(text, "SwapFree:", swap_free);
+
+        double used = static_cast<double>(mem_total - mem_available + swap_total - swap_free);
+        value = used / static_cast<double>(mem_total + swap_total) * 100;
+        return true;
+    }
+
+    bool is_open() const { return meminfo.is_open(); }
+
+private:
+    static bool field(std::string_view text, std::string_view key, uint64_t& value) {
+        size_t pos = find_line(text, key);
+        return pos != std::string_view::npos && next_uint(text, pos, value);
+    }
+
+    ProcFile meminfo;
+};
+
+// Porcentagem do tempo em que o disco esteve ocupado com E/S desde a leitura
+// anterior (coluna io_ticks de /proc/diskstats)
+class DiskUsageReader : public SensorReader {
+public:
+    explicit DiskUsageReader(const std::string& device) : diskstats("/proc/diskstats", 65536), device(device) {
+        if (diskstats.is_open()) {
+            sample(last_io_ms);
+        }
+        last_time = std::chrono::steady_clock::now();
+    }
+
+    bool read(double& value) override {
+        uint64_t io_ms;
+        if (!sample(io_ms)) {
+            return false;
+        }
+        auto now = std::chrono::steady_clock::now();
+        double elapsed_ms = std::chrono::duration<double, std::milli>(now - last_time).count();
+        value = elapsed_ms <= 0 ? 0.0 : std::min(100.0, 100.0 * static_cast<double>(io_ms - last_io_ms) / elapsed_ms);
+        last_io_ms = io_ms;
+        last_time = now;
+        return true;
+    }
+
+    bool is_open() const { return diskstats.is_open(); }
+
+    // Primeiro disco físico listado em /sys/block (ignora loop, ram, zram e dispositivos virtuais)
+    static std::string default_device() {
+        ProcFile diskstats("/proc/diskstats", 65536);
+        std::istringstream lines{std::string(diskstats.read())};
+        std::string line;
+        while (std::getline(lines, line)) {
+            std::istringstream fields(line);
+            std::string major, minor, name;
+            fields >> major >> minor >> name;
+            if (access(("/sys/block/" + name + "/device").c_str(), F_OK) == 0) {
+                return name;
+            }
+        }
+        return "";
+    }
+
+private:
+    bool sample(uint64_t& io_ms) {
+        std::string_view text = diskstats.read();
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find('\n', pos);
+            std::string_view line = text.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+            // "major minor nome leituras ... io_ticks ..." (io_ticks é a 10ª coluna após o nome)
+            size_t field_pos = 0;
+            uint64_t major, minor;
+            if (next_uint(line, field_pos, major) && next_uint(line, field_pos, minor)) {
+                size_t name_start = line.find_first_not_of(' ', field_pos);
+                size_t name_end = line.find(' ', name_start);
+                if (name_start != std::string_view::npos && line.substr(name_start, name_end - name_start) == device) {
+                    field_pos = name_end;
+                    uint64_t field = 0;
+                    for (int i = 0; i < 10; ++i) {
+                        if (!next_uint(line, field_pos, field)) {
+                            return false;
+                        }
+                    }
+                    io_ms = field;
+                    return true;
+                }
+            }
+            if (end == std::string_view::npos) {
+                break;
+            }
+            pos = end + 1;
+        }
+        return false;
+    }
+
+    ProcFile diskstats;
+    std::string device;
+    uint64_t last_io_ms = 0;
+    std::chrono::steady_clock::time_point last_time;
+};
+
+// Bytes por segundo recebidos e enviados por todas as interfaces, exceto loopback (/proc/net/dev)
+class NetworkThroughputReader : public SensorReader {
+public:
+    NetworkThroughputReader() : netdev("/proc/net/dev", 16384) {
+        if (netdev.is_open()) {
+            sample(last_bytes);
+        }
+        last_time = std::chrono::steady_clock::now();
+    }
+
+    bool read(double& value) override {
+        uint64_t bytes;
+        if (!sample(bytes)) {
+            return false;
+        }
+        auto now = std::chrono::steady_clock::now();
+        double elapsed_s = std::chrono::duration<double>(now - last_time).count();
+        value = elapsed_s <= 0 ? 0.0 : static_cast<double>(bytes - last_bytes) / elapsed_s;
+        last_bytes = bytes;
+        last_time = now;
+        return true;
+    }
+
+    bool is_open() const { return netdev.is_open(); }
+
+private:
+    bool sample(uint64_t& bytes) {
+        std::string_view text = netdev.read();
+        bytes = 0;
+        size_t pos = text.find('\n', text.find('\n') + 1); // pula as duas linhas de cabeçalho
+        while (pos != std::string_view::npos && pos + 1 < text.size()) {
+            size_t colon = text.find(':', pos);
+            if (colon == std::string_view::npos) {
+                break;
+            }
+            std::string_view name = text.substr(pos + 1, colon - pos - 1);
+            name.remove_prefix(std::min(name.find_first_not_of(' '), name.size()));
+            size_t field_pos = colon + 1;
+            uint64_t fields[9];
+            for (int i = 0; i < 9; ++i) {
+                if (!next_uint(text, field_pos, fields[i])) {
+                    return false;
+                }
+            }
+            if (name != "lo") {
+                bytes += fields[0] + fields[8]; // bytes recebidos + bytes enviados
+            }
+            pos = text.find('\n', field_pos);
+        }
+        return true;
+    }
+
+    ProcFile netdev;
+    uint64_t last_bytes = 0;
+    std::chrono::steady_clock::time_point last_time;
+};
+
+// Temperatura em graus Celsius de uma zona térmica (/sys/class/thermal)
+class ThermalReader : public SensorReader {
+public:
+    explicit ThermalReader(const std::string& zone) : temp("/sys/class/thermal/" + zone + "/temp", 64) {}
+
+    bool read(double& value) override {
+        std::string_view text = temp.read();
+        size_t pos = 0;
+        uint64_t millidegrees;
+        if (!next_uint(text, pos, millidegrees)) {
+            return false;
+        }
+        value = static_cast<double>(millidegrees) / 1000.0;
+        return true;
+    }
+
+    bool is_open() const { return temp.is_open(); }
 
-        long long virtualMemUsed = memInfo.totalram - memInfo.freeram;
-        virtualMemUsed += memInfo.totalswap - memInfo.freeswap;
-        virtualMemUsed *= memInfo.mem_unit;
+private:
+    ProcFile temp;
+};
+
+// O leitor, se o seu arquivo pôde ser aberto; senão nullptr, para que o sensor
+// seja descartado na partida em vez de falhar a cada leitura
+template <typename Reader>
+std::unique_ptr<SensorReader> if_open(std::unique_ptr<Reader> reader) {
+    if (!reader->is_open()) {
+        return nullptr;
+    }
+    return reader;
+}
 
-        float memoryPercentage = ((float)virtualMemUsed / totalVirtualMem) * 100;
-        return memoryPercentage;
+// Cria o leitor de um sensor a partir do seu id; nullptr se o sensor não existir nesta máquina
+std::unique_ptr<SensorReader> make_sensor_reader(const std::string& sensor_id, const nlohmann::json& options) {
+    if (sensor_id == "cpu_usage") {
+        return if_open(std::make_unique<CpuUsageReader>());
+    } else if (sensor_id == "memory_usage") {
+        return if_open(std::make_unique<MemoryUsageReader>());
+    } else if (sensor_id == "disk_io_usage") {
+        std::string device = options.value("device", DiskUsageReader::default_device());
+        if (device.empty() || access(("/sys/block/" + device).c_str(), F_OK) != 0) {
+            return nullptr;
+        }
+        return if_open(std::make_unique<DiskUsageReader>(device));
+    } else if (sensor_id == "network_throughput") {
+        return if_open(std::make_unique<NetworkThroughputReader>());
+    } else if (sensor_id == "cpu_temperature") {
+        return if_open(std::make_unique<ThermalReader>(options.value("zone", std::string("thermal_zone0"))));
     }
-    return -1; // Indicando erro ao obter informações de memória
+    return nullptr;
 }
 
+// ENVIO AO BROKER ---------------------------------------------------------------------------------------------
+
+#define DEFAULT_MAX_INFLIGHT 32        // Mensagens publicadas aguardando confirmação do broker
+#define DEFAULT_OFFLINE_BUFFER_MB 16   // Tamanho do arquivo de mensagens pendentes
+#define RECONNECT_BACKOFF_MIN_MS 500
+#define RECONNECT_BACKOFF_MAX_MS 30000
+
+// Fila circular de mensagens (tópico + payload) num arquivo mapeado em memória.
+// Toda mensagem passa por ela: as leituras são só copiadas para o arquivo e a
+// thread de envio as publica em ordem. Enquanto o broker está fora do ar elas se
+// acumulam aqui (inclusive entre execuções do processo) e são reenviadas quando a
+// conexão volta. Se o arquivo encher, as mensagens mais antigas são descartadas.
+//
+// Há três posições virtuais, que só crescem: head (mais antiga ainda não
+// confirmada), send (próxima a publicar) e tail (fim). head e tail ficam gravadas
+// no cabeçalho do arquivo.
+class MappedRing {
+public:
+    ~MappedRing() {
+        if (header != nullptr) {
+            msync(header, HEADER_SIZE + capacity, MS_SYNC);
+            munmap(header, HEADER_SIZE + capacity);
+        }
+    }
+
+    bool open(const std::string& path, uint64_t size) {
+        capacity = size;
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1 || ftruncate(fd, static_cast<off_t>(HEADER_SIZE + capacity)) == -1) {
+            std::cerr << "Erro ao abrir o buffer de mensagens " << path << ": " << std::strerror(errno) << "\n";
+            if (fd != -1) {
+                close(fd);
+            }
+            return false;
+        }
+        void* mapping = mmap(nullptr, HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Erro ao mapear o buffer de mensagens " << path << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+        header = static_cast<Header*>(mapping);
+        data = static_cast<char*>(mapping) + HEADER_SIZE;
+
+        // Reaproveita mensagens pendentes de uma execução anterior com o mesmo tamanho
+        if (header->magic != MAGIC || header->capacity != capacity || header->tail - header->head > capacity) {
+            header->magic = MAGIC;
+            header->capacity = capacity;
+            header->head = header->tail = 0;
+        } else if (header->tail != header->head) {
+            std::clog << "Recovered " << (header->tail - header->head) << " bytes of pending messages" << std::endl;
+        }
+        send = header->head;
+        return true;
+    }
+
+    void append(const std::string& topic, const std::string& payload) {
+        uint64_t length = record_length(topic.size(), payload.size());
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        if (length > capacity / 2) {
+            std::cerr << "Mensagem grande demais para o buffer: " << topic << "\n";
+            return;
+        }
+
+        uint64_t offset = header->tail % capacity;
+        uint64_t padding = capacity - offset < length ? capacity - offset : 0;
+        while (header->tail + padding + length - header->head > capacity) {
+            drop_oldest();
+        }
+        if (padding > 0) {
+            // O registro não cabe antes do fim do arquivo: marca o resto como vazio e volta ao início
+            if (padding >= sizeof(uint32_t)) {
+                uint32_t marker = WRAP_MARKER;
+                std::memcpy(data + offset, &marker, sizeof(marker));
+            }
+            header->tail += padding;
+            offset = 0;
+        }
+
+        uint32_t sizes[2] = {static_cast<uint32_t>(topic.size()), static_cast<uint32_t>(payload.size())};
+        std::memcpy(data + offset, sizes, sizeof(sizes));
+        std::memcpy(data + offset + sizeof(sizes), topic.data(), topic.size());
+        std::memcpy(data + offset + sizeof(sizes) + topic.size(), payload.data(), payload.size());
+        header->tail += length;
+    }
+
+    // Copia a próxima mensagem ainda não publicada; false se não houver nenhuma
+    bool next_unsent(std::string& topic, std::string& payload) {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        if (send == header->tail) {
+            return false;
+        }
+        uint64_t offset = locate(send);
+        uint32_t sizes[2];
+        std::memcpy(sizes, data + offset, sizeof(sizes));
+        topic.assign(data + offset + sizeof(sizes), sizes[0]);
+        payload.assign(data + offset + sizeof(sizes) + sizes[0], sizes[1]);
+        send += record_length(sizes[0], sizes[1]);
+        return true;
+    }
+
+    // O broker confirmou a mensagem mais antiga em trânsito
+    void commit_one() {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        if (dropped_in_flight > 0) {
+            --dropped_in_flight; // confirmação de uma mensagem já descartada pelo drop_oldest
+        } else if (header->head != send) {
+            skip_record(header->head);
+        }
+    }
+
+    // A conexão caiu: as mensagens não confirmadas serão publicadas de novo
+    void rewind() {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        send = header->head;
+        dropped_in_flight = 0;
+    }
+
+    bool has_unsent() {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        return send != header->tail;
+    }
+
+    size_t dropped() const {
+        return dropped_messages.load(std::memory_order_relaxed);
+    }
+
+    void flush_async() {
+        msync(header, HEADER_SIZE + capacity, MS_ASYNC);
+    }
+
+private:
+    struct Header {
+        uint64_t magic;
+        uint64_t capacity;
+        uint64_t head;
+        uint64_t tail;
+    };
+
+    static constexpr uint64_t MAGIC = 0x53454e534f524d31; // "SENSORM1"
+    static constexpr uint64_t HEADER_SIZE = 4096;
+    static constexpr uint32_t WRAP_MARKER = 0xffffffff;
+
+    static uint64_t record_length(size_t topic_size, size_t payload_size) {
+        return (2 * sizeof(uint32_t) + topic_size + payload_size + 7) & ~uint64_t(7);
+    }
+
+    // Posição física do registro em `position`, pulando o espaço vazio no fim do arquivo
+    uint64_t locate(uint64_t& position) {
+        uint64_t offset = position % capacity;
+        uint32_t marker = 0;
+        if (capacity - offset >= sizeof(marker)) {
+            std::memcpy(&marker, data + offset, sizeof(marker));
+        }
+        if (capacity - offset < 2 * sizeof(uint32_t) || marker == WRAP_MARKER) {
+            position += capacity - offset;
+            offset = 0;
+        }
+        return offset;
+    }
+
+    void skip_record(uint64_t& position) {
+        uint64_t offset = locate(position);
+        uint32_t sizes[2];
+        std::memcpy(sizes, data + offset, sizeof(sizes));
+        position += record_length(sizes[0], sizes[1]);
+    }
+
+    // Descarta o registro em head. Se ele já foi publicado, a sua confirmação
+    // ainda vai chegar e não pode avançar head sobre outro registro.
+    void drop_oldest() {
+        if (header->head != send) {
+            ++dropped_in_flight;
+        }
+        skip_record(header->head);
+        if (send < header->head) {
+            send = header->head;
+        }
+        dropped_messages.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Header* header = nullptr;
+    char* data = nullptr;
+    uint64_t capacity = 0;
+    uint64_t send = 0;
+    size_t dropped_in_flight = 0; // descartadas entre head e send, com confirmação pendente
+    std::mutex ring_mtx;
+    std::atomic<size_t> dropped_messages{0};
+};
+
+// Mantém a conexão com o broker e publica o conteúdo do MappedRing com o
+// cliente assíncrono, limitando as mensagens em trânsito a max_inflight. As
+// tarefas de leitura apenas chamam publish(), que nunca espera pela rede.
+class BrokerLink : public virtual mqtt::callback {
+public:
+    BrokerLink(mqtt::async_client& client, const mqtt::connect_options& options, MappedRing& ring, size_t max_inflight)
+        : client(client), options(options), ring(ring), max_inflight(max_inflight) {
+        client.set_callback(*this);
+    }
+
+    void publish(const std::string& topic, const std::string& payload) {
+        {
+            // A thread de envio avalia o predicado com link_mtx: sem a trava o aviso poderia se perder
+            std::lock_guard<std::mutex> lock(link_mtx);
+            ring.append(topic, payload);
+        }
+        link_cv.notify_one();
+    }
+
+    // Função chamada a cada (re)conexão, antes de reenviar as mensagens pendentes
+    void on_connect(std::function<void()> handler) {
+        connect_handler = std::move(handler);
+    }
+
+    void run() {
+        auto backoff = std::chrono::milliseconds(RECONNECT_BACKOFF_MIN_MS);
+        auto last_sync = std::chrono::steady_clock::now();
+        std::string topic, payload;
+
+        while (true) {
+            if (!client.is_connected()) {
+                try {
+                    client.connect(options)->wait();
+                } catch (mqtt::exception& e) {
+                    std::cerr << "Error: " << e.what() << " (reconectando em " << backoff.count() << " ms)" << std::endl;
+                    std::this_thread::sleep_for(backoff);
+                    backoff = std::min(backoff * 2, std::chrono::milliseconds(RECONNECT_BACKOFF_MAX_MS));
+                    continue;
+                }
+                std::clog << "connected to the broker" << std::endl;
+                backoff = std::chrono::milliseconds(RECONNECT_BACKOFF_MIN_MS);
+                {
+                    std::lock_guard<std::mutex> lock(link_mtx);
+                    inflight = 0;
+                    connection_lost_flag = false;
+                    ring.rewind();
+                }
+                if (connect_handler) {
+                    connect_handler();
+                }
+            } else {
+                // Uma publicação falhou sem que a conexão caísse: reenvia o que não foi confirmado
+                std::lock_guard<std::mutex> lock(link_mtx);
+                if (connection_lost_flag) {
+                    inflight = 0;
+                    connection_lost_flag = false;
+                    ring.rewind();
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(link_mtx);
+            link_cv.wait_for(lock, std::chrono::seconds(1), [this] {
+                return connection_lost_flag || (inflight < max_inflight && ring.has_unsent());
+            });
+            while (!connection_lost_flag && inflight < max_inflight && ring.next_unsent(topic, payload)) {
+                ++inflight;
+                lock.unlock();
+                try {
+                    client.publish(mqtt::make_message(topic, payload, QOS, false));
+                } catch (mqtt::exception& e) {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                    lock.lock();
+                    connection_lost_flag = true;
+                    break;
+                }
+                lock.lock();
+            }
+            lock.unlock();
+
+            // Os dados do arquivo vão para o disco em segundo plano
+            if (std::chrono::steady_clock::now() - last_sync > std::chrono::seconds(1)) {
+                ring.flush_async();
+                last_sync = std::chrono::steady_clock::now();
+                if (ring.dropped() > reported_drops) {
+                    std::cerr << "Buffer de mensagens cheio: " << ring.dropped() - reported_drops << " mensagem(ns) descartada(s)\n";
+                    reported_drops = ring.dropped();
+                }
+            }
+        }
+    }
+
+    void connection_lost(const std::string& cause) override {
+        std::cerr << "Connection to the broker lost: " << cause << std::endl;
+        {
+            std::lock_guard<std::mutex> lock(link_mtx);
+            connection_lost_flag = true;
+        }
+        link_cv.notify_one();
+    }
+
+    void delivery_complete(mqtt::delivery_token_ptr) override {
+        {
+            std::lock_guard<std::mutex> lock(link_mtx);
+            if (inflight > 0) {
+                --inflight;
+                ring.commit_one();
+            }
+        }
+        link_cv.notify_one();
+    }
+
+private:
+    mqtt::async_client& client;
+    mqtt::connect_options options;
+    MappedRing& ring;
+    size_t max_inflight;
+    std::function<void()> connect_handler;
+
+    std::mutex link_mtx;
+    std::condition_variable link_cv;
+    size_t inflight = 0;
+    bool connection_lost_flag = false;
+    size_t reported_drops = 0;
+};
+
 // Função para enviar a mensagem inicial do SensorMonitor
-void sendInitialMessage(mqtt::client& client, const std::string& machineId, const std::vector<SensorInfo>& sensors) {
+void sendInitialMessage(BrokerLink& link, const std::string& machineId, const std::vector<SensorInfo>& sensors,
+    const BatchConfig& batch) {
     nlohmann::json initialMessage;
 
     initialMessage["machine_id"] = machineId;
@@ -86,86 +769,295 @@ void sendInitialMessage(mqtt::client& client, const std::string& machineId, cons
         sensorJson["sensor_id"] = sensor.sensor_id;
         sensorJson["data_type"] = sensor.data_type;
         sensorJson["data_interval"] = sensor.data_interval;
+        if (sensor.sampling.deadband_enabled() || sensor.sampling.adaptive()) {
+            const SamplingPolicy& sampling = sensor.sampling;
+            sensorJson["sampling"] = {
+                {"deadband", sampling.deadband},
+                {"deadband_pct", sampling.deadband_pct},
+                {"heartbeat_intervals", sampling.heartbeat_intervals},
+                {"min_interval", sampling.min_interval},
+                {"max_interval", sampling.max_interval},
+                {"max_gap_ms", sensor.max_gap()}
+            };
+        }
 
         initialMessage["sensors"].push_back(sensorJson);
     }
 
-    mqtt::message msg("/sensor_monitors", initialMessage.dump(), QOS, false);
-    client.publish(msg);
-    std::clog << "Initial message published: " << initialMessage.dump() << std::endl;
+    if (batch.enabled()) {
+        initialMessage["batch"] = {
+            {"format", batch.format},
+            {"max_samples", batch.max_samples},
+            {"max_delay_ms", batch.max_delay.count()}
+        };
+    }
+
+    std::string payload = initialMessage.dump();
+    link.publish("/sensor_monitors", payload);
+    if (log_published_messages) {
+        std::clog << "Initial message published: " << payload << '\n';
+    }
+}
+
+// TAREFAS DE AMOSTRAGEM ---------------------------------------------------------------------------------------
+
+// Timestamp ISO 8601 em UTC com milissegundos (ex.: 2023-06-01T15:30:00.250Z)
+std::string format_timestamp(std::chrono::system_clock::time_point time) {
+    std::time_t seconds = std::chrono::system_clock::to_time_t(time);
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000;
+    std::tm now_tm;
+    gmtime_r(&seconds, &now_tm); // Using gmtime to get UTC time
+
+    char buffer[32];
+    size_t length = std::strftime(buffer, sizeof(buffer), "%FT%T", &now_tm);
+    std::snprintf(buffer + length, sizeof(buffer) - length, ".%03dZ", static_cast<int>(millis));
+    return buffer;
+}
+
+// Monta um lote [[epoch_ms, valor], ...]. Em CBOR o lote começa com a tag
+// "self-described CBOR" (0xd9d9f7), que permite ao data_processor distingui-lo
+// de uma mensagem JSON.
+std::string encode_batch(const std::vector<std::pair<int64_t, double>>& samples, const std::string& format) {
+    nlohmann::json frame = nlohmann::json::array();
+    for (const auto& sample : samples) {
+        frame.push_back({sample.first, sample.second});
+    }
+    if (format == "cbor") {
+        std::string payload = "\xd9\xd9\xf7";
+        nlohmann::json::to_cbor(frame, payload);
+        return payload;
+    }
+    return frame.dump();
+}
+
+// Lê e publica um sensor no seu próprio ritmo, independente dos demais. O
+// próximo horário é calculado a partir do anterior, e não do fim da leitura,
+// para que o período não acumule atrasos.
+void run_sensor_task(BrokerLink& link, const std::string& machineId, const SensorInfo& sensor, SensorReader& reader,
+    const BatchConfig& batch_config) {
+    using clock = std::chrono::steady_clock;
+    const std::string topic = "/sensors/" + machineId + "/" + sensor.sensor_id;
+    const SamplingPolicy& sampling = sensor.sampling;
+    const auto heartbeat = std::chrono::milliseconds(sensor.max_gap());
+    auto interval = std::chrono::milliseconds(sensor.data_interval);
+    auto next_run = clock::now() + interval;
+    auto last_publish = clock::time_point::min();
+    double last_published = 0.0;
+
+    std::vector<std::pair<int64_t, double>> batch;
+    batch.reserve(batch_config.max_samples);
+    auto batch_deadline = clock::time_point::max();
+
+    auto flush_batch = [&] {
+        link.publish(topic, encode_batch(batch, batch_config.format));
+        if (log_published_messages) {
+            std::clog << "Batch published - topic: " << topic << " - samples: " << batch.size() << '\n';
+        }
+        batch.clear();
+        batch_deadline = clock::time_point::max();
+    };
+
+    while (true) {
+        std::this_thread::sleep_until(std::min(next_run, batch_deadline));
+        if (clock::now() >= batch_deadline) {
+            flush_batch();
+            if (clock::now() < next_run) {
+                continue;
+            }
+        }
+        next_run += interval;
+
+        double value;
+        if (!reader.read(value)) {
+            std::cerr << "Erro ao ler o sensor " << sensor.sensor_id << "\n";
+            continue;
+        }
+        auto now = std::chrono::system_clock::now();
+
+        bool changed = last_publish == clock::time_point::min() || sampling.changed(value, last_published);
+        if (sampling.adaptive()) {
+            auto adapted = changed ? std::chrono::milliseconds(sampling.min_interval)
+                                   : std::min(std::chrono::milliseconds(sampling.max_interval),
+                                              std::chrono::duration_cast<std::chrono::milliseconds>(interval * ADAPTIVE_SLOWDOWN));
+            next_run += adapted - interval;
+            interval = adapted;
+        }
+        // Sem mudança, publica só se a próxima leitura já passaria do heartbeat
+        if (sampling.deadband_enabled() && !changed && clock::now() + interval - last_publish <= heartbeat) {
+            if (next_run < clock::now()) {
+                next_run = clock::now() + interval;
+            }
+            continue;
+        }
+        last_publish = clock::now();
+        last_published = value;
+
+        if (batch_config.enabled()) {
+            if (batch.empty()) {
+                batch_deadline = clock::now() + batch_config.max_delay;
+            }
+            batch.emplace_back(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count(), value);
+            if (batch.size() >= batch_config.max_samples) {
+                flush_batch();
+            }
+        } else {
+            nlohmann::json sensorJson;
+            sensorJson["timestamp"] = format_timestamp(now);
+            sensorJson["value"] = value;
+
+            std::string payload = sensorJson.dump();
+            link.publish(topic, payload);
+            if (log_published_messages) {
+                std::clog << "Message published - topic: " << topic << " - message: " << payload << '\n';
+            }
+        }
+
+        // Se a leitura atrasou mais de um período, recomeça a contagem em vez de disparar leituras em sequência
+        if (next_run < clock::now()) {
+            next_run = clock::now() + interval;
+        }
+    }
 }
 
 
 int main(int argc, char* argv[]) {
     std::string machineId;
+    nlohmann::json config = nlohmann::json::object();
 
-    if (argc != 2) {
-        std::cout << "Por favor, forneça o machine_id como argumento." << std::endl;
+    if (argc != 2 && argc != 3) {
+        std::cout << "Por favor, forneça o machine_id como argumento (e, opcionalmente, um arquivo de configuração)." << std::endl;
         return EXIT_FAILURE;
     } else {
         machineId = argv[1];
     }
+
+    // Configuração opcional. Exemplo:
+    // { "announce_interval_s": 10,
+    //   "sensors": { "cpu_usage": { "data_interval": 250 }, "disk_io_usage": { "device": "sda" },
+    //                "memory_usage": { "deadband_pct": 1, "heartbeat_intervals": 5,
+    //                                  "min_interval": 1000, "max_interval": 10000 },
+    //                "cpu_temperature": { "enabled": false } },
+    //   "batch": { "format": "cbor", "max_samples": 20, "max_delay_ms": 5000 },
+    //   "max_inflight": 32, "offline_buffer": { "path": "/var/tmp/sensor-monitor.ring", "size_mb": 16 },
+    //   "log_level": "warn" }
+    if (argc == 3) {
+        std::ifstream configFile(argv[2]);
+        try {
+            config = nlohmann::json::parse(configFile);
+        } catch (nlohmann::json::exception& e) {
+            std::cerr << "Error: Invalid configuration: " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string logLevel = config.value("log_level", std::string("info"));
+    if (logLevel != "debug" && logLevel != "info" && logLevel != "warn" && logLevel != "error") {
+        std::cerr << "Error: log_level must be debug, info, warn or error" << std::endl;
+        return EXIT_FAILURE;
+    }
+    log_published_messages = logLevel == "debug" || logLevel == "info";
+
+    const auto announce_interval = std::chrono::seconds(config.value("announce_interval_s", MESSAGE_INTERVAL));
+    if (announce_interval.count() <= 0) {
+        std::cerr << "Error: announce_interval_s must be greater than zero" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    BatchConfig batch;
+    if (config.contains("batch")) {
+        const nlohmann::json& batchJson = config["batch"];
+        batch.format = batchJson.value("format", std::string("json"));
+        batch.max_samples = batchJson.value("max_samples", static_cast<size_t>(10));
+        batch.max_delay = std::chrono::milliseconds(batchJson.value("max_delay_ms", 1000));
+        if ((batch.format != "json" && batch.format != "cbor") || batch.max_samples == 0 || batch.max_delay.count() <= 0) {
+            std::cerr << "Error: Invalid batch configuration" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    nlohmann::json bufferConfig = config.value("offline_buffer", nlohmann::json::object());
+    MappedRing ring;
+    if (!ring.open(bufferConfig.value("path", "/var/tmp/sensor-monitor-" + machineId + ".ring"),
+                   bufferConfig.value("size_mb", static_cast<uint64_t>(DEFAULT_OFFLINE_BUFFER_MB)) * 1024 * 1024)) {
+        return EXIT_FAILURE;
+    }
+
     std::string clientId = "sensor-monitor-" + machineId;
-    mqtt::client client(BROKER_ADDRESS, clientId);
+    mqtt::async_client client(BROKER_ADDRESS, clientId);
 
     // Connect to the MQTT broker.
     mqtt::connect_options connOpts;
     connOpts.set_keep_alive_interval(20);
     connOpts.set_clean_session(true);
 
-    try {
-        client.connect(connOpts);
-    } catch (mqtt::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
-        return EXIT_FAILURE;
-    }
-    std::clog << "connected to the broker" << std::endl;
+    BrokerLink link(client, connOpts, ring, config.value("max_inflight", static_cast<size_t>(DEFAULT_MAX_INFLIGHT)));
 
     // Definição dos sensores a serem monitorados
-    std::vector<SensorInfo> sensors = {
-        {"cpu_usage", "float", 5000}, // Sensor de uso da CPU
-        {"memory_usage", "float", 5000} // Sensor de uso de memória
+    std::vector<SensorInfo> available_sensors = {
+        {"cpu_usage", "float", DEFAULT_DATA_INTERVAL, {}}, // Sensor de uso da CPU
+        {"memory_usage", "float", DEFAULT_DATA_INTERVAL, {}}, // Sensor de uso de memória
+        {"disk_io_usage", "float", DEFAULT_DATA_INTERVAL, {}}, // Sensor de ocupação do disco
+        {"network_throughput", "float", DEFAULT_DATA_INTERVAL, {}}, // Sensor de tráfego de rede (bytes/s)
+        {"cpu_temperature", "float", DEFAULT_DATA_INTERVAL, {}} // Sensor de temperatura
     };
 
-    // Enviar a mensagem inicial
-    sendInitialMessage(client, machineId, sensors);
+    std::vector<SensorInfo> sensors;
+    std::vector<std::unique_ptr<SensorReader>> readers;
+    nlohmann::json sensorsConfig = config.value("sensors", nlohmann::json::object());
+    for (SensorInfo sensor : available_sensors) {
+        nlohmann::json options = sensorsConfig.value(sensor.sensor_id, nlohmann::json::object());
+        if (!options.value("enabled", true)) {
+            continue;
+        }
+        sensor.data_interval = options.value("data_interval", sensor.data_interval);
+        if (sensor.data_interval <= 0) {
+            std::cerr << "Error: Invalid data_interval for sensor " << sensor.sensor_id << std::endl;
+            return EXIT_FAILURE;
+        }
+        SamplingPolicy& sampling = sensor.sampling;
+        sampling.deadband = options.value("deadband", 0.0);
+        sampling.deadband_pct = options.value("deadband_pct", 0.0);
+        sampling.heartbeat_intervals = options.value("heartbeat_intervals", DEFAULT_HEARTBEAT_INTERVALS);
+        sampling.min_interval = options.value("min_interval", sensor.data_interval);
+        sampling.max_interval = options.value("max_interval", sensor.data_interval);
+        if (sampling.deadband < 0.0 || sampling.deadband_pct < 0.0 || sampling.heartbeat_intervals <= 0 ||
+            sampling.min_interval <= 0 || sampling.min_interval > sensor.data_interval ||
+            sampling.max_interval < sensor.data_interval) {
+            std::cerr << "Error: Invalid sampling policy for sensor " << sensor.sensor_id << std::endl;
+            return EXIT_FAILURE;
+        }
+        // A amostragem adaptativa usa o deadband para decidir o que é uma mudança
+        if (sampling.adaptive() && !sampling.deadband_enabled()) {
+            std::cerr << "Error: Adaptive sampling for sensor " << sensor.sensor_id << " requires a deadband" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        auto reader = make_sensor_reader(sensor.sensor_id, options);
+        if (!reader) {
+            std::clog << "Sensor " << sensor.sensor_id << " not available on this machine" << std::endl;
+            continue;
+        }
+        sensors.push_back(sensor);
+        readers.push_back(std::move(reader));
+    }
+
+    // Enviar a mensagem inicial a cada conexão com o broker
+    link.on_connect([&] {
+        sendInitialMessage(link, machineId, sensors, batch);
+    });
+    std::thread link_thread(&BrokerLink::run, &link);
 
+    // Uma tarefa independente por sensor
+    std::vector<std::thread> tasks;
+    for (size_t i = 0; i < sensors.size(); ++i) {
+        tasks.emplace_back(run_sensor_task, std::ref(link), std::cref(machineId), std::cref(sensors[i]),
+            std::ref(*readers[i]), std::cref(batch));
+    }
+
+    // Reenvia a mensagem inicial periodicamente
     while (true) {
-        // Get the current time in ISO 8601 format in UTC.
-        auto now = std::chrono::system_clock::now();
-        std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-        std::tm* now_tm = std::gmtime(&now_c); // Using gmtime to get UTC time
-
-        std::stringstream ss;
-        ss << std::put_time(now_tm, "%FT%TZ");
-        std::string timestamp = ss.str();
-
-        // Get sensor readings
-        float cpuUsage = getCPUUsage();
-        float memoryUsage = getMemoryUsage();
-
-        // Publish CPU usage to MQTT
-        nlohmann::json cpuJson;
-        cpuJson["timestamp"] = timestamp;
-        cpuJson["value"] = cpuUsage;
-
-        std::string cpuTopic = "/sensors/" + machineId + "/cpu_usage";
-        mqtt::message cpuMsg(cpuTopic, cpuJson.dump(), QOS, false);
-        client.publish(cpuMsg);
-        std::clog << "CPU message published - topic: " << cpuTopic << " - message: " << cpuJson.dump() << std::endl;
-
-        // Publish memory usage to MQTT
-        nlohmann::json memoryJson;
-        memoryJson["timestamp"] = timestamp;
-        memoryJson["value"] = memoryUsage;
-
-        std::string memoryTopic = "/sensors/" + machineId + "/memory_usage";
-        mqtt::message memoryMsg(memoryTopic, memoryJson.dump(), QOS, false);
-        client.publish(memoryMsg);
-        std::clog << "Memory message published - topic: " << memoryTopic << " - message: " << memoryJson.dump() << std::endl;
-
-        // Sleep for some time.
-        std::this_thread::sleep_for(std::chrono::seconds(MESSAGE_INTERVAL));
+        std::this_thread::sleep_for(announce_interval);
+        sendInitialMessage(link, machineId, sensors, batch);
     }
 
     return EXIT_SUCCESS;